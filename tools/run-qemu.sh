@@ -0,0 +1,26 @@
+#!/bin/sh
+# Builds a sanitizer kernel and runs stress.sh in it under QEMU with
+# virtme-ng (https://github.com/arighi/virtme-ng).
+#
+#   KDIR=~/linux tools/run-qemu.sh kasan
+#   KDIR=~/linux tools/run-qemu.sh kcsan
+#
+# Extra environment (PADS, DURATION, ...) is passed on to stress.sh.
+
+set -eu
+
+SANITIZER=${1:-kasan}
+TOOLS=$(cd "$(dirname "$0")" && pwd)
+REPO=$(dirname "$TOOLS")
+KDIR=${KDIR:?set KDIR to a kernel source tree}
+
+(cd "$KDIR" && vng --build --config "$TOOLS/$SANITIZER.config")
+make -C "$KDIR" M="$REPO" modules
+make -C "$TOOLS"
+
+cd "$KDIR"
+vng --run . --user root --cpus 4 --memory 4G --rwdir "$REPO" \
+	--exec "PADS=${PADS:-4} DURATION=${DURATION:-60} \
+	  CHURN_MS=${CHURN_MS:-500} RELOAD_S=${RELOAD_S:-10} \
+	  LINK_TIMEOUT_MS=${LINK_TIMEOUT_MS:-300} \
+	  $TOOLS/stress.sh"
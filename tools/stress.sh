@@ -0,0 +1,191 @@
+#!/bin/sh
+# Connect/disconnect/input stress for xusb and all four transports,
+# meant for a throwaway VM with a KASAN or KCSAN kernel (see
+# run-qemu.sh). Needs root, dummy_hcd, libcomposite and usb_f_fs.
+#
+# Every pad is a FunctionFS gadget on its own dummy_hcd UDC, bound and
+# unbound at random while xusb-stress hammers the userspace side. Pads
+# take turns being wired 360, wireless 360, Xbox One and original Xbox.
+# One of the transports gets reloaded now and then too. Afterwards
+# dmesg is searched for sanitizer and lockdep reports; any of them
+# fails the run.
+#
+#   PADS=4               pads, one dummy UDC each
+#   DURATION=60          seconds
+#   CHURN_MS=500         longest a pad stays bound or unbound
+#   RELOAD_S=10          seconds between transport reloads, 0 disables
+#   LINK_TIMEOUT_MS=300  xbox360wr.link_timeout_ms, short enough for
+#                        the wireless pads' quiet spells to hit it
+#   KO=..                where the modules are
+
+set -eu
+
+PADS=${PADS:-4}
+DURATION=${DURATION:-60}
+CHURN_MS=${CHURN_MS:-500}
+RELOAD_S=${RELOAD_S:-10}
+LINK_TIMEOUT_MS=${LINK_TIMEOUT_MS:-300}
+
+TOOLS=$(cd "$(dirname "$0")" && pwd)
+KO=${KO:-$TOOLS/..}
+GADGETS=/sys/kernel/config/usb_gadget
+LOGS=$(mktemp -d)
+
+if [ "$(id -u)" -ne 0 ]; then
+	echo "Needs root." >&2
+	exit 2
+fi
+
+make -s -C "$TOOLS"
+
+modprobe dummy_hcd num="$PADS"
+modprobe libcomposite
+modprobe usb_f_fs
+
+grep -q " $(dirname $GADGETS) configfs" /proc/mounts ||
+	mount -t configfs none "$(dirname $GADGETS)"
+
+TRANSPORTS="xbox360 xbox360wr xbox1 xbox"
+
+load_transport() {
+	case $1 in
+	xbox360wr) insmod "$KO/$1.ko" link_timeout_ms="$LINK_TIMEOUT_MS" ;;
+	*) insmod "$KO/$1.ko" ;;
+	esac
+}
+
+lsmod | grep -q "^xusb " || insmod "$KO/xusb.ko"
+for t in $TRANSPORTS; do
+	lsmod | grep -q "^$t " || load_transport $t
+done
+
+dmesg -C
+
+end=$(( $(date +%s) + DURATION ))
+
+# Random sleep up to CHURN_MS.
+nap() {
+	ms=$(( $(od -An -N2 -tu2 /dev/urandom) % CHURN_MS + 1 ))
+	sleep "$(( ms / 1000 )).$(printf %03d $(( ms % 1000 )))"
+}
+
+# Kind and product ID for pad N, in turn.
+pad_kind() {
+	case $(( $1 % 4 )) in
+	0) echo "wired 0x028e" ;;
+	1) echo "wireless 0x0719" ;;
+	2) echo "xbox1 0x02ea" ;;
+	3) echo "xbox 0x0289" ;;
+	esac
+}
+
+setup_pad() {
+	g=$GADGETS/xusb$1
+	set -- "$1" $(pad_kind "$1")
+
+	mkdir "$g"
+	echo 0x045e > "$g/idVendor"
+	echo "$3" > "$g/idProduct"
+	echo 0x0114 > "$g/bcdDevice"
+
+	mkdir "$g/strings/0x409"
+	echo "xusb-stress" > "$g/strings/0x409/manufacturer"
+	echo "Controller" > "$g/strings/0x409/product"
+	echo "stress$1" > "$g/strings/0x409/serialnumber"
+
+	mkdir "$g/configs/c.1"
+	mkdir "$g/functions/ffs.pad$1"
+	ln -s "$g/functions/ffs.pad$1" "$g/configs/c.1/"
+
+	mkdir -p "/dev/ffs-pad$1"
+	mount -t functionfs "pad$1" "/dev/ffs-pad$1"
+
+	"$TOOLS/xusb-stress" pad "$2" "/dev/ffs-pad$1" "$DURATION" \
+		> "$LOGS/pad$1" 2>&1 &
+
+	# Descriptors have to be written before the gadget can bind.
+	while [ ! -e "/dev/ffs-pad$1/ep1" ]; do sleep 0.1; done
+}
+
+teardown_pad() {
+	g=$GADGETS/xusb$1
+
+	echo "" > "$g/UDC" 2>/dev/null || true
+	rm -f "$g/configs/c.1/ffs.pad$1"
+	rmdir "$g/configs/c.1" "$g/functions/ffs.pad$1" \
+		"$g/strings/0x409" "$g" 2>/dev/null || true
+	umount "/dev/ffs-pad$1" 2>/dev/null || true
+	rmdir "/dev/ffs-pad$1" 2>/dev/null || true
+}
+
+churn_pad() {
+	g=$GADGETS/xusb$1
+	udc=$2
+
+	while [ "$(date +%s)" -lt "$end" ]; do
+		echo "$udc" > "$g/UDC" 2>/dev/null || true
+		nap
+		echo "" > "$g/UDC" 2>/dev/null || true
+		nap
+	done
+
+	echo "" > "$g/UDC" 2>/dev/null || true
+}
+
+# Round robin, so every transport is pulled out from under its pads.
+reload_driver() {
+	reloads=0
+
+	while [ "$(date +%s)" -lt "$end" ]; do
+		for t in $TRANSPORTS; do
+			sleep "$RELOAD_S"
+			[ "$(date +%s)" -lt "$end" ] || break
+
+			if rmmod $t && load_transport $t; then
+				reloads=$(( reloads + 1 ))
+			fi
+		done
+	done
+
+	echo "$reloads transport reloads" > "$LOGS/reloads"
+}
+
+UDCS=$(ls /sys/class/udc | grep dummy_udc | head -n "$PADS")
+
+i=0
+for udc in $UDCS; do
+	setup_pad $i
+	churn_pad $i "$udc" &
+	i=$(( i + 1 ))
+done
+
+if [ "$RELOAD_S" -gt 0 ]; then
+	reload_driver &
+fi
+
+echo "Running $i pads for ${DURATION}s..."
+"$TOOLS/xusb-stress" hammer "$DURATION" > "$LOGS/hammer" 2>&1 || true
+
+wait
+
+i=0
+for udc in $UDCS; do
+	teardown_pad $i
+	i=$(( i + 1 ))
+done
+
+cat "$LOGS"/pad* "$LOGS/hammer" "$LOGS"/reloads 2>/dev/null
+
+# Anything from KASAN, KCSAN, lockdep, UBSAN or a plain WARN/BUG.
+if dmesg | grep -E -A20 \
+    'BUG:|WARNING:|UBSAN:|possible circular locking|inconsistent lock state|possible recursive locking|general protection fault|Oops' \
+    > "$LOGS/findings"; then
+	echo
+	echo "Sanitizer findings:"
+	cat "$LOGS/findings"
+	exit 1
+fi
+
+echo
+echo "No sanitizer findings."
+rm -rf "$LOGS"
@@ -0,0 +1,1205 @@
+/* Stress test for xusb and its transports.
+
+   Two halves, both run by stress.sh:
+
+   xusb-stress pad <wired|wireless|xbox1|xbox> <functionfs dir> <seconds>
+     Pretends to be a pad through FunctionFS. Meant to sit behind
+     dummy_hcd so the real probe, disconnect and URB paths run without
+     hardware. Sends input as fast as the host polls, with a button
+     edge every so often, and counts what comes back on OUT. Wireless
+     pads also connect and disconnect through the adapter's status
+     packets, go quiet long enough for the link timeout, and come with
+     a chatpad now and then. Xbox One pads wait to be powered on and
+     want their guide button acked.
+
+   xusb-stress hammer <seconds>
+     Everything userspace can do to xusb at once while the pads come
+     and go: /dev/xusb readers at full rate and coalesced with edges,
+     open/close churn, state/keystroke/history queries, taps, evdev
+     rumble, LED and poll_interval writes and copilot regrouping.
+
+   Both print what they got through at the end. Neither checks for
+   sanitizer reports, stress.sh does that from dmesg. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/input.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+
+#include "../xusb.h"
+
+
+static struct timespec deadline;
+
+static int expired(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec > deadline.tv_sec ||
+	  (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+}
+
+static void set_deadline(const char *seconds)
+{
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += atoi(seconds);
+}
+
+/* Write a string to a sysfs file, ignoring errors. Pads vanish
+   underneath us all the time, that's the point. */
+static void write_sysfs(const char *path, const char *value)
+{
+	int fd = open(path, O_WRONLY);
+
+	if (fd < 0)
+		return;
+
+	if (write(fd, value, strlen(value)) < 0) {
+		/* Expected for devices going away and bad values. */
+	}
+
+	close(fd);
+}
+
+static int read_sysfs_uint(const char *path, unsigned int *value)
+{
+	char buffer[32];
+	ssize_t length;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return -1;
+
+	length = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+
+	if (length <= 0)
+		return -1;
+
+	buffer[length] = 0;
+	*value = strtoul(buffer, NULL, 0);
+
+	return 0;
+}
+
+/* Pad emulator */
+
+/* htole32() isn't constant, these are. */
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define cpu_to_le16(x) (x)
+#define cpu_to_le32(x) (x)
+#else
+#define cpu_to_le16(x) __builtin_bswap16(x)
+#define cpu_to_le32(x) __builtin_bswap32(x)
+#endif
+
+struct pad;
+
+/* What each transport binds to and how the pad behaves. The VID:PID
+   is set up by stress.sh on the gadget, see its setup_pad(). */
+struct pad_kind {
+	const char *name;
+	uint8_t class, subclass, protocol;
+	uint16_t packet_size;
+
+	void *(*in_thread)(void *);
+	void (*out_packet)(struct pad *pad, const uint8_t *packet,
+	  ssize_t length);
+};
+
+struct pad {
+	const struct pad_kind *kind;
+	int in, out;
+
+	/* Bumped on every bind, so the IN side starts over the way a
+	   replugged pad would. */
+	unsigned int binds;
+
+	/* Set by the OUT side for the IN side to act on. */
+	int presence_queries;
+	int powered;
+
+	unsigned long reports;
+	unsigned long in_errors;
+	unsigned long out_packets;
+	unsigned long rumbles;
+	unsigned long leds;
+	unsigned long commands;
+
+	/* Wireless */
+	unsigned long connects;
+	unsigned long disconnects;
+	unsigned long silences;
+	unsigned long chatpad_keys;
+	unsigned long unplugs;
+
+	/* Xbox One */
+	unsigned long announces;
+	unsigned long acks;
+};
+
+#define PAD_COUNT(pad, field) \
+	__atomic_add_fetch(&(pad)->field, 1, __ATOMIC_RELAXED)
+
+static unsigned int pad_binds(struct pad *pad)
+{
+	return __atomic_load_n(&pad->binds, __ATOMIC_ACQUIRE);
+}
+
+static long now_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Writes block until the host polls, or until the function is
+   enabled in the first place. */
+static int pad_send(struct pad *pad, const void *packet, size_t size)
+{
+	if (write(pad->in, packet, size) < 0) {
+		PAD_COUNT(pad, in_errors);
+		usleep(1000);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Sleeps for up to ms, or until the pad is rebound. */
+static void pad_sleep(struct pad *pad, unsigned int binds, long ms)
+{
+	long end = now_ms() + ms;
+
+	while (now_ms() < end && pad_binds(pad) == binds && !expired())
+		usleep(1000);
+}
+
+/* A goes down and up every 50 reports, B every 333, so edge readers
+   have something to chew on. Every so often there's a run of
+   identical reports, like an idle pad. */
+static void pad_fill_gamepad(unsigned long n, uint16_t *buttons,
+  int16_t *stick)
+{
+	*buttons = 0;
+	*stick = (int16_t)((n * 977) & 0xFFFF);
+
+	if ((n / 50) & 1)
+		*buttons |= 0x1000;
+	if ((n / 333) & 1)
+		*buttons |= 0x2000;
+
+	if ((n / 1000) % 4 == 3) {
+		*buttons = 0;
+		*stick = 0;
+	}
+}
+
+/* The 360 layout, used by both wired and wireless. */
+static void pad_fill_360(uint8_t *out, unsigned long n)
+{
+	uint16_t buttons;
+	int16_t stick;
+
+	pad_fill_gamepad(n, &buttons, &stick);
+
+	out[0] = buttons & 0xFF;
+	out[1] = buttons >> 8;
+	out[2] = stick >> 8;
+	out[3] = ~stick >> 8;
+
+	for (int i = 0; i < 4; ++i) {
+		out[4 + i * 2] = stick & 0xFF;
+		out[5 + i * 2] = stick >> 8;
+	}
+}
+
+/* Wired 360 */
+
+static void *wired_in_thread(void *data)
+{
+	struct pad *pad = data;
+	uint8_t report[20] = { 0x00, 0x14 };
+
+	while (!expired()) {
+		pad_fill_360(&report[2], pad->reports);
+
+		if (pad_send(pad, report, sizeof(report)) == 0)
+			PAD_COUNT(pad, reports);
+	}
+
+	return NULL;
+}
+
+static void wired_out_packet(struct pad *pad, const uint8_t *packet,
+  ssize_t length)
+{
+	if (packet[0] == 0x00 && packet[1] == 0x08)
+		PAD_COUNT(pad, rumbles);
+	else if (packet[0] == 0x01 && packet[1] == 0x03)
+		PAD_COUNT(pad, leds);
+}
+
+/* Wireless 360. One gadget is one of the receiver's pad slots. It
+   connects, sometimes with a chatpad plugged in, then either has the
+   adapter report it gone or just goes quiet for a while so the link
+   timer has to notice. Quiet spells are random, so some are shorter
+   than xbox360wr.link_timeout_ms and some are longer. */
+
+#define WIRELESS_PACKET_SIZE 29
+
+static int wireless_status(struct pad *pad, int connected, int attachment)
+{
+	uint8_t status[2] = {
+		0x08, connected ? (attachment ? 0xC0 : 0x80) : 0x00
+	};
+
+	return pad_send(pad, status, sizeof(status));
+}
+
+/* Presence queries are answered like the adapter does, unless the
+   pad is meant to have gone quiet. */
+static void wireless_answer(struct pad *pad, int connected, int attachment)
+{
+	if (__atomic_exchange_n(&pad->presence_queries, 0, __ATOMIC_RELAXED))
+		wireless_status(pad, connected, attachment);
+}
+
+static void wireless_event(struct pad *pad, uint8_t header, uint8_t *packet)
+{
+	memset(packet, 0, WIRELESS_PACKET_SIZE);
+	packet[0] = 0x00;
+	packet[1] = header;
+	packet[2] = header == 0xF8 ? 0x01 : 0x00;
+	packet[3] = 0xF0;
+}
+
+static void wireless_connected(struct pad *pad, unsigned int binds,
+  int *attachment, long ms)
+{
+	long end = now_ms() + ms;
+	uint8_t packet[WIRELESS_PACKET_SIZE];
+	unsigned long n = 0;
+
+	while (now_ms() < end && pad_binds(pad) == binds && !expired()) {
+		wireless_answer(pad, 1, *attachment);
+
+		/* Ping pairs, sometimes with the second half missing. */
+		if (n % 250 == 0) {
+			wireless_event(pad, 0xF8, packet);
+			pad_send(pad, packet, WIRELESS_PACKET_SIZE);
+
+			if (rand() % 8) {
+				packet[2] = 0x02;
+				pad_send(pad, packet, WIRELESS_PACKET_SIZE);
+			}
+		}
+
+		if (*attachment && n % 20 == 0) {
+			/* Modifiers, then up to two keys, from byte 24. */
+			wireless_event(pad, 0x02, packet);
+			packet[24] = (n / 20) % 4 ? 0x00 : 0xF0;
+			packet[25] = (n / 40) & 0x03;
+			packet[26] = (n / 20) & 1 ? 0x17 : 0x00;
+
+			if (pad_send(pad, packet, WIRELESS_PACKET_SIZE) == 0)
+				PAD_COUNT(pad, chatpad_keys);
+		}
+
+		/* Chatpad pulled out while the pad stays on. */
+		if (*attachment && rand() % 2000 == 0) {
+			*attachment = 0;
+			wireless_status(pad, 1, 0);
+			PAD_COUNT(pad, unplugs);
+		}
+
+		wireless_event(pad, 0x01, packet);
+		packet[5] = 0x13;
+		pad_fill_360(&packet[6], pad->reports);
+
+		if (pad_send(pad, packet, WIRELESS_PACKET_SIZE) == 0)
+			PAD_COUNT(pad, reports);
+
+		++n;
+	}
+}
+
+static void *wireless_in_thread(void *data)
+{
+	struct pad *pad = data;
+
+	while (!expired()) {
+		unsigned int binds = pad_binds(pad);
+		int attachment = rand() & 1;
+		long end;
+
+		if (wireless_status(pad, 1, attachment))
+			continue;
+
+		PAD_COUNT(pad, connects);
+
+		while (pad_binds(pad) == binds && !expired()) {
+			wireless_connected(pad, binds, &attachment,
+			  200 + rand() % 2000);
+
+			/* Quiet without a word. Whatever the driver makes
+			   of it, input picks up again afterwards. */
+			if (rand() % 3)
+				break;
+
+			PAD_COUNT(pad, silences);
+			pad_sleep(pad, binds, 50 + rand() % 1500);
+		}
+
+		if (pad_binds(pad) != binds)
+			continue;
+
+		/* The adapter says it's gone, and means it for a while. */
+		if (wireless_status(pad, 0, 0) == 0)
+			PAD_COUNT(pad, disconnects);
+
+		end = now_ms() + 50 + rand() % 500;
+		while (now_ms() < end && pad_binds(pad) == binds && !expired()) {
+			wireless_answer(pad, 0, 0);
+			usleep(1000);
+		}
+	}
+
+	return NULL;
+}
+
+static void wireless_out_packet(struct pad *pad, const uint8_t *packet,
+  ssize_t length)
+{
+	if (length < 4)
+		return;
+
+	if (packet[0] == 0x08 && packet[2] == 0x0F && packet[3] == 0xC0)
+		__atomic_store_n(&pad->presence_queries, 1, __ATOMIC_RELAXED);
+	else if (packet[0] == 0x00 && packet[1] == 0x01)
+		PAD_COUNT(pad, rumbles);
+	else if (packet[0] == 0x00 && packet[2] == 0x08)
+		PAD_COUNT(pad, leds);
+	else if (packet[0] == 0x00 && packet[2] == 0x0C)
+		PAD_COUNT(pad, commands);
+}
+
+/* Xbox One. Announces itself, sits quiet until powered on, then
+   sends input with a sequence number, the guide button on its own
+   with the ack flag set, and a heartbeat. Now and then it resets
+   and announces itself again, like the real ones do. */
+
+#define GIP_PACKET_SIZE 64
+
+static void *xbox1_in_thread(void *data)
+{
+	struct pad *pad = data;
+	uint8_t packet[GIP_PACKET_SIZE];
+	uint8_t seq = 0;
+
+	while (!expired()) {
+		unsigned int binds = pad_binds(pad);
+		unsigned long n = 0;
+
+		__atomic_store_n(&pad->powered, 0, __ATOMIC_RELAXED);
+
+		memset(packet, 0, sizeof(packet));
+		packet[0] = 0x02; /* Announce */
+		packet[1] = 0x20;
+		packet[2] = seq++;
+		packet[3] = 0x1C;
+
+		if (pad_send(pad, packet, 4 + 0x1C))
+			continue;
+
+		PAD_COUNT(pad, announces);
+
+		/* Announced again if nobody's listening. */
+		pad_sleep(pad, binds, 200);
+
+		while (__atomic_load_n(&pad->powered, __ATOMIC_RELAXED) &&
+		    pad_binds(pad) == binds && !expired()) {
+			uint16_t buttons;
+			int16_t stick;
+
+			if (rand() % 5000 == 0)
+				break;
+
+			if (n % 100 == 0) {
+				/* Guide, resent once under the same number
+				   like an unacked one would be. */
+				memset(packet, 0, sizeof(packet));
+				packet[0] = 0x07;
+				packet[1] = 0x30;
+				packet[2] = seq++;
+				packet[3] = 0x02;
+				packet[4] = (n / 100) & 1;
+				packet[5] = 0x5B;
+
+				pad_send(pad, packet, 6);
+				pad_send(pad, packet, 6);
+			}
+
+			if (n % 250 == 0) {
+				memset(packet, 0, sizeof(packet));
+				packet[0] = 0x03;
+				packet[1] = 0x20;
+				packet[2] = seq++;
+				packet[3] = 0x04;
+
+				pad_send(pad, packet, 8);
+			}
+
+			pad_fill_gamepad(pad->reports, &buttons, &stick);
+
+			memset(packet, 0, sizeof(packet));
+			packet[0] = 0x20;
+			packet[1] = 0x00;
+			packet[2] = seq++;
+			packet[3] = 0x0E;
+			packet[4] = buttons & 0x1000 ? 0x10 : 0x00;
+			packet[5] = buttons & 0x2000 ? 0x10 : 0x00;
+			packet[6] = stick & 0xFF;
+			packet[7] = (stick >> 8) & 0x03;
+
+			for (int i = 0; i < 4; ++i) {
+				packet[10 + i * 2] = stick & 0xFF;
+				packet[11 + i * 2] = stick >> 8;
+			}
+
+			if (pad_send(pad, packet, 18) == 0)
+				PAD_COUNT(pad, reports);
+
+			++n;
+		}
+	}
+
+	return NULL;
+}
+
+static void xbox1_out_packet(struct pad *pad, const uint8_t *packet,
+  ssize_t length)
+{
+	switch (packet[0]) {
+	case 0x01:
+		PAD_COUNT(pad, acks);
+		break;
+	case 0x05:
+		PAD_COUNT(pad, commands);
+		__atomic_store_n(&pad->powered, 1, __ATOMIC_RELAXED);
+		break;
+	case 0x09:
+		PAD_COUNT(pad, rumbles);
+		break;
+	case 0x0A:
+		PAD_COUNT(pad, leds);
+		break;
+	}
+}
+
+/* Original Xbox. Digital buttons, then analog face buttons and
+   triggers, then the sticks. */
+
+static void *xbox_in_thread(void *data)
+{
+	struct pad *pad = data;
+	uint8_t report[20] = { 0x00, 0x14 };
+
+	while (!expired()) {
+		uint16_t buttons;
+		int16_t stick;
+
+		pad_fill_gamepad(pad->reports, &buttons, &stick);
+
+		memset(&report[2], 0, sizeof(report) - 2);
+		report[4] = buttons & 0x1000 ? 0xFF : 0x00; /* A */
+		report[5] = buttons & 0x2000 ? 0xFF : 0x00; /* B */
+		report[10] = stick >> 8;
+		report[11] = ~stick >> 8;
+
+		for (int i = 0; i < 4; ++i) {
+			report[12 + i * 2] = stick & 0xFF;
+			report[13 + i * 2] = stick >> 8;
+		}
+
+		if (pad_send(pad, report, sizeof(report)) == 0)
+			PAD_COUNT(pad, reports);
+	}
+
+	return NULL;
+}
+
+static void xbox_out_packet(struct pad *pad, const uint8_t *packet,
+  ssize_t length)
+{
+	if (packet[0] == 0x00 && packet[1] == 0x06)
+		PAD_COUNT(pad, rumbles);
+}
+
+static const struct pad_kind pad_kinds[] = {
+	{ "wired", 0xFF, 0x5D, 0x01, 32, wired_in_thread, wired_out_packet },
+	{ "wireless", 0xFF, 0x5D, 0x81, 32, wireless_in_thread,
+	  wireless_out_packet },
+	{ "xbox1", 0xFF, 0x47, 0xD0, 64, xbox1_in_thread, xbox1_out_packet },
+	{ "xbox", 0x58, 0x42, 0x00, 32, xbox_in_thread, xbox_out_packet }
+};
+
+static const struct pad_kind *find_pad_kind(const char *name)
+{
+	for (size_t i = 0; i < sizeof(pad_kinds) / sizeof(pad_kinds[0]); ++i) {
+		if (strcmp(pad_kinds[i].name, name) == 0)
+			return &pad_kinds[i];
+	}
+
+	return NULL;
+}
+
+struct pad_endpoints {
+	struct usb_interface_descriptor intf;
+	struct usb_endpoint_descriptor_no_audio in;
+	struct usb_endpoint_descriptor_no_audio out;
+} __attribute__((packed));
+
+static struct {
+	struct usb_functionfs_descs_head_v2 header;
+	__le32 fs_count;
+	__le32 hs_count;
+	struct pad_endpoints fs, hs;
+} __attribute__((packed)) pad_descriptors = {
+	.header = {
+		.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+		.flags = cpu_to_le32(FUNCTIONFS_HAS_FS_DESC |
+		  FUNCTIONFS_HAS_HS_DESC),
+		.length = cpu_to_le32(sizeof(pad_descriptors)),
+	},
+	.fs_count = cpu_to_le32(3),
+	.hs_count = cpu_to_le32(3)
+};
+
+/* Same as the real things, minus the vendor specific blobs. The
+   drivers only match on the interface. */
+static void pad_fill_endpoints(struct pad_endpoints *out,
+  const struct pad_kind *kind, uint8_t out_interval)
+{
+	out->intf = (struct usb_interface_descriptor) {
+		.bLength = sizeof(struct usb_interface_descriptor),
+		.bDescriptorType = USB_DT_INTERFACE,
+		.bNumEndpoints = 2,
+		.bInterfaceClass = kind->class,
+		.bInterfaceSubClass = kind->subclass,
+		.bInterfaceProtocol = kind->protocol,
+		.iInterface = 1
+	};
+
+	out->in = (struct usb_endpoint_descriptor_no_audio) {
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 1 | USB_DIR_IN,
+		.bmAttributes = USB_ENDPOINT_XFER_INT,
+		.wMaxPacketSize = cpu_to_le16(kind->packet_size),
+		.bInterval = 4
+	};
+
+	out->out = out->in;
+	out->out.bEndpointAddress = 2 | USB_DIR_OUT;
+	out->out.bInterval = out_interval;
+}
+
+#define PAD_STRING "xusb-stress pad"
+
+static const struct {
+	struct usb_functionfs_strings_head header;
+	struct {
+		__le16 code;
+		const char str1[sizeof(PAD_STRING)];
+	} __attribute__((packed)) lang0;
+} __attribute__((packed)) pad_strings = {
+	.header = {
+		.magic = cpu_to_le32(FUNCTIONFS_STRINGS_MAGIC),
+		.length = cpu_to_le32(sizeof(pad_strings)),
+		.str_count = cpu_to_le32(1),
+		.lang_count = cpu_to_le32(1),
+	},
+	.lang0 = {
+		cpu_to_le16(0x0409),
+		PAD_STRING
+	}
+};
+
+static void *pad_out_thread(void *data)
+{
+	struct pad *pad = data;
+	uint8_t packet[64];
+
+	while (!expired()) {
+		ssize_t length = read(pad->out, packet, sizeof(packet));
+
+		if (length < 2) {
+			usleep(1000);
+			continue;
+		}
+
+		PAD_COUNT(pad, out_packets);
+		pad->kind->out_packet(pad, packet, length);
+	}
+
+	return NULL;
+}
+
+/* Nothing xusb does goes through ep0, so anything but the events
+   gets stalled. */
+static void pad_handle_ep0(struct pad *pad, int ep0)
+{
+	struct usb_functionfs_event event;
+
+	if (read(ep0, &event, sizeof(event)) != sizeof(event))
+		return;
+
+	switch (event.type) {
+	case FUNCTIONFS_ENABLE:
+		__atomic_add_fetch(&pad->binds, 1, __ATOMIC_RELEASE);
+		break;
+	case FUNCTIONFS_SETUP:
+		if (event.u.setup.bRequestType & USB_DIR_IN) {
+			if (read(ep0, NULL, 0) < 0) {
+				/* Stalled, as intended. */
+			}
+		} else {
+			if (write(ep0, NULL, 0) < 0) {
+				/* Same. */
+			}
+		}
+		break;
+	}
+}
+
+static int pad_main(const char *kind, const char *dir, const char *seconds)
+{
+	struct pad pad = { 0 };
+	pthread_t in_thread, out_thread;
+	char path[256];
+	double elapsed;
+	int ep0;
+
+	pad.kind = find_pad_kind(kind);
+	if (!pad.kind) {
+		fprintf(stderr, "Unknown pad kind %s\n", kind);
+		return 2;
+	}
+
+	/* 4ms at full speed, 2^(4-1) microframes = 1ms at high speed. */
+	pad_fill_endpoints(&pad_descriptors.fs, pad.kind, 8);
+	pad_fill_endpoints(&pad_descriptors.hs, pad.kind, 4);
+
+	snprintf(path, sizeof(path), "%s/ep0", dir);
+	ep0 = open(path, O_RDWR);
+	if (ep0 < 0) {
+		perror(path);
+		return 1;
+	}
+
+	if (write(ep0, &pad_descriptors, sizeof(pad_descriptors)) < 0 ||
+	    write(ep0, &pad_strings, sizeof(pad_strings)) < 0) {
+		perror("Writing descriptors");
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/ep1", dir);
+	pad.in = open(path, O_RDWR);
+	snprintf(path, sizeof(path), "%s/ep2", dir);
+	pad.out = open(path, O_RDWR);
+
+	if (pad.in < 0 || pad.out < 0) {
+		perror("Opening endpoints");
+		return 1;
+	}
+
+	srand(getpid());
+	set_deadline(seconds);
+	elapsed = atof(seconds);
+
+	pthread_create(&in_thread, NULL, pad.kind->in_thread, &pad);
+	pthread_create(&out_thread, NULL, pad_out_thread, &pad);
+
+	while (!expired()) {
+		struct pollfd fds = { .fd = ep0, .events = POLLIN };
+
+		if (poll(&fds, 1, 100) > 0)
+			pad_handle_ep0(&pad, ep0);
+	}
+
+	printf("%s pad %s: %u binds, %lu reports (%.0f/s), %lu write errors, "
+	  "%lu out packets (%lu rumble, %lu led, %lu commands)\n",
+	  pad.kind->name, dir, pad.binds, pad.reports, pad.reports / elapsed,
+	  pad.in_errors, pad.out_packets, pad.rumbles, pad.leds,
+	  pad.commands);
+
+	if (pad.kind->in_thread == wireless_in_thread) {
+		printf("  %lu connects, %lu disconnects, %lu silences, "
+		  "%lu chatpad packets, %lu chatpad unplugs\n",
+		  pad.connects, pad.disconnects, pad.silences,
+		  pad.chatpad_keys, pad.unplugs);
+	} else if (pad.kind->in_thread == xbox1_in_thread) {
+		printf("  %lu announces, %lu acks\n", pad.announces, pad.acks);
+	}
+
+	/* The endpoint threads may be stuck in I/O on an unbound
+	   function. Exiting closes everything from under them. */
+	fflush(stdout);
+	_exit(0);
+}
+
+/* Hammer */
+
+struct worker {
+	const char *name;
+	void *(*run)(void *);
+	pthread_t thread;
+
+	unsigned long ops;
+	unsigned long events;
+	unsigned long edges;
+	unsigned long errors;
+};
+
+static void *reader_thread(struct worker *worker,
+  __u32 coalesce_us, __u32 edges)
+{
+	struct xusb_wait wait = { .mask = 0, .coalesce_us = coalesce_us };
+	struct xusb_event events[16];
+	int fd = open("/dev/xusb", O_RDONLY);
+
+	if (fd < 0) {
+		worker->errors++;
+		return NULL;
+	}
+
+	if (ioctl(fd, XUSB_IOC_SET_WAIT, &wait) < 0)
+		worker->errors++;
+
+	if (edges && ioctl(fd, XUSB_IOC_SET_EDGES, &edges) < 0)
+		worker->errors++;
+
+	while (!expired()) {
+		struct pollfd fds = { .fd = fd, .events = POLLIN };
+		ssize_t length;
+
+		if (poll(&fds, 1, 100) <= 0)
+			continue;
+
+		length = read(fd, events, sizeof(events));
+		worker->ops++;
+
+		if (length < 0) {
+			worker->errors++;
+			continue;
+		}
+
+		for (size_t i = 0; i < length / sizeof(events[0]); ++i) {
+			worker->events++;
+
+			if (events[i].Flags & XUSB_EVENT_EDGE)
+				worker->edges++;
+		}
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static void *full_reader(void *data)
+{
+	return reader_thread(data, 0, 0);
+}
+
+/* The menu/overlay case: 30Hz plus every press. */
+static void *edge_reader(void *data)
+{
+	return reader_thread(data, 33000, 0xFFFF);
+}
+
+static void *open_churn(void *data)
+{
+	struct worker *worker = data;
+	int efd = eventfd(0, EFD_NONBLOCK);
+
+	while (!expired()) {
+		struct xusb_wait wait = {
+			.mask = rand() & 0xF,
+			.coalesce_us = rand() % 2000
+		};
+		__u32 edges = rand() & 0xFFFF;
+		__s32 event_fd = efd;
+		char buffer[sizeof(struct xusb_event) * 4];
+		int fd = open("/dev/xusb", O_RDONLY | O_NONBLOCK);
+
+		if (fd < 0) {
+			worker->errors++;
+			continue;
+		}
+
+		ioctl(fd, XUSB_IOC_SET_WAIT, &wait);
+		ioctl(fd, XUSB_IOC_SET_EDGES, &edges);
+		ioctl(fd, XUSB_IOC_SET_EVENTFD, &event_fd);
+
+		/* Sometimes leave with things pending and the timer armed. */
+		if (rand() & 1) {
+			usleep(rand() % 3000);
+
+			if (read(fd, buffer, sizeof(buffer)) > 0)
+				worker->events++;
+		}
+
+		close(fd);
+		worker->ops++;
+	}
+
+	close(efd);
+	return NULL;
+}
+
+static void *query_thread(void *data)
+{
+	struct worker *worker = data;
+	struct xusb_history_entry entries[32];
+	struct timespec now;
+
+	while (!expired()) {
+		for (__u32 i = 0; i < 4; ++i) {
+			struct xusb_event state = { .dwUserIndex = i };
+			struct xusb_ioctl_keystroke keystroke = { .dwUserIndex = i };
+			struct xusb_history_query query = {
+				.dwUserIndex = i,
+				.count = 32,
+				.entries = (uintptr_t)entries
+			};
+			int fd = open("/dev/xusb", O_RDONLY);
+
+			if (fd < 0) {
+				worker->errors++;
+				continue;
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			query.To = now.tv_sec * 1000000000LL + now.tv_nsec;
+			query.From = query.To - 50000000LL;
+
+			if (ioctl(fd, XUSB_IOC_GET_STATE, &state) == 0)
+				worker->events++;
+
+			while (ioctl(fd, XUSB_IOC_GET_KEYSTROKE, &keystroke) == 0)
+				worker->edges++;
+
+			if (ioctl(fd, XUSB_IOC_HISTORY, &query) < 0)
+				worker->errors++;
+
+			close(fd);
+			worker->ops += 3;
+		}
+	}
+
+	return NULL;
+}
+
+static const char *drivers[] = { "xbox360", "xbox360wr", "xbox1", "xbox" };
+
+/* Interfaces currently bound to any of the transports. */
+static glob_t find_interfaces(void)
+{
+	glob_t found = { 0 };
+
+	for (size_t i = 0; i < sizeof(drivers) / sizeof(drivers[0]); ++i) {
+		char pattern[64];
+
+		snprintf(pattern, sizeof(pattern), "/sys/bus/usb/drivers/%s/*:*",
+		  drivers[i]);
+		glob(pattern, i ? GLOB_APPEND : 0, NULL, &found);
+	}
+
+	return found;
+}
+
+static void *tap_thread(void *data)
+{
+	struct worker *worker = data;
+
+	while (!expired()) {
+		glob_t found = find_interfaces();
+
+		for (size_t i = 0; i < found.gl_pathc && !expired(); ++i) {
+			struct xusb_tap_request request = { .frames = 64 };
+			char path[512];
+			void *ring;
+			int xusb, tap;
+
+			snprintf(path, sizeof(path), "%s/../busnum", found.gl_pathv[i]);
+			if (read_sysfs_uint(path, &request.busnum))
+				continue;
+
+			snprintf(path, sizeof(path), "%s/../devnum", found.gl_pathv[i]);
+			if (read_sysfs_uint(path, &request.devnum))
+				continue;
+
+			snprintf(path, sizeof(path), "%s/bInterfaceNumber",
+			  found.gl_pathv[i]);
+			if (read_sysfs_uint(path, &request.ifnum))
+				continue;
+
+			xusb = open("/dev/xusb", O_RDONLY);
+			if (xusb < 0) {
+				worker->errors++;
+				continue;
+			}
+
+			tap = ioctl(xusb, XUSB_IOC_TAP, &request);
+			close(xusb);
+			worker->ops++;
+
+			/* Gone already, or someone else's tap. */
+			if (tap < 0)
+				continue;
+
+			ring = mmap(NULL, 64 * 4096, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, tap, 0);
+
+			if (ring != MAP_FAILED) {
+				struct pollfd fds = { .fd = tap, .events = POLLIN };
+
+				if (poll(&fds, 1, rand() % 20) > 0)
+					worker->events++;
+
+				munmap(ring, 64 * 4096);
+			}
+
+			close(tap);
+		}
+
+		globfree(&found);
+		usleep(1000);
+	}
+
+	return NULL;
+}
+
+/* Every input device xusb registers, chatpads included. Rumble just
+   fails on the chatpad, reading it is what matters there. */
+static const char *input_names[] = {
+	"Microsoft X-Box 360 pad",
+	"Xbox 360 Wireless Receiver",
+	"Microsoft X-Box One pad",
+	"Microsoft X-Box pad",
+	"Xbox 360 Chatpad"
+};
+
+static int is_pad(const char *event_dir)
+{
+	char path[512], name[128] = { 0 };
+	ssize_t length;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/device/name", event_dir);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	length = read(fd, name, sizeof(name) - 1);
+	close(fd);
+
+	if (length <= 0)
+		return 0;
+
+	name[strcspn(name, "\n")] = 0;
+
+	for (size_t i = 0; i < sizeof(input_names) / sizeof(input_names[0]); ++i) {
+		if (strcmp(name, input_names[i]) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void *evdev_thread(void *data)
+{
+	struct worker *worker = data;
+
+	while (!expired()) {
+		glob_t found = { 0 };
+
+		glob("/sys/class/input/event*", 0, NULL, &found);
+
+		for (size_t i = 0; i < found.gl_pathc && !expired(); ++i) {
+			struct ff_effect effect = {
+				.type = FF_RUMBLE,
+				.id = -1,
+				.replay = { .length = 100 },
+				.u.rumble = {
+					.strong_magnitude = rand() & 0xFFFF,
+					.weak_magnitude = rand() & 0xFFFF
+				}
+			};
+			struct input_event events[64];
+			struct input_event play = {
+				.type = EV_FF,
+				.value = 1
+			};
+			char path[512];
+			int fd;
+
+			if (!is_pad(found.gl_pathv[i]))
+				continue;
+
+			snprintf(path, sizeof(path), "/dev/input/%s",
+			  strrchr(found.gl_pathv[i], '/') + 1);
+
+			fd = open(path, O_RDWR | O_NONBLOCK);
+			if (fd < 0)
+				continue;
+
+			if (ioctl(fd, EVIOCSFF, &effect) == 0) {
+				play.code = effect.id;
+
+				if (write(fd, &play, sizeof(play)) < 0)
+					worker->errors++;
+			}
+
+			for (int n = 0; n < 10; ++n) {
+				ssize_t length = read(fd, events, sizeof(events));
+
+				if (length <= 0)
+					break;
+
+				worker->events += length / sizeof(events[0]);
+			}
+
+			close(fd);
+			worker->ops++;
+		}
+
+		globfree(&found);
+	}
+
+	return NULL;
+}
+
+static void *sysfs_thread(void *data)
+{
+	static const char *intervals[] = { "0", "1000", "2000", "4000", "8000" };
+	static const char *groups[] = { "0 1", "0", "1 2 3", "1", "2 0", "2" };
+	struct worker *worker = data;
+
+	while (!expired()) {
+		glob_t leds = { 0 };
+		glob_t found = find_interfaces();
+		char value[16];
+
+		glob("/sys/class/leds/xusb*/brightness", 0, NULL, &leds);
+
+		for (size_t i = 0; i < leds.gl_pathc; ++i) {
+			snprintf(value, sizeof(value), "%d", rand() % 14);
+			write_sysfs(leds.gl_pathv[i], value);
+			worker->ops++;
+		}
+
+		for (size_t i = 0; i < found.gl_pathc; ++i) {
+			char path[512];
+
+			snprintf(path, sizeof(path), "%s/poll_interval",
+			  found.gl_pathv[i]);
+			write_sysfs(path, intervals[rand() % 5]);
+			worker->ops++;
+		}
+
+		write_sysfs("/sys/class/misc/xusb/copilot", groups[rand() % 6]);
+		worker->ops++;
+
+		globfree(&leds);
+		globfree(&found);
+		usleep(rand() % 5000);
+	}
+
+	/* Don't leave pads merged for whoever's next. */
+	for (int i = 0; i < 4; ++i) {
+		char value[4];
+
+		snprintf(value, sizeof(value), "%d", i);
+		write_sysfs("/sys/class/misc/xusb/copilot", value);
+	}
+
+	return NULL;
+}
+
+static struct worker workers[] = {
+	{ .name = "full rate reader", .run = full_reader },
+	{ .name = "full rate reader", .run = full_reader },
+	{ .name = "30Hz+edges reader", .run = edge_reader },
+	{ .name = "30Hz+edges reader", .run = edge_reader },
+	{ .name = "open/close churn", .run = open_churn },
+	{ .name = "state queries", .run = query_thread },
+	{ .name = "packet taps", .run = tap_thread },
+	{ .name = "evdev rumble", .run = evdev_thread },
+	{ .name = "sysfs writes", .run = sysfs_thread }
+};
+
+static int hammer_main(const char *seconds)
+{
+	double elapsed = atof(seconds);
+
+	if (access("/dev/xusb", R_OK) != 0) {
+		perror("/dev/xusb");
+		return 1;
+	}
+
+	srand(getpid());
+	set_deadline(seconds);
+
+	for (size_t i = 0; i < sizeof(workers) / sizeof(workers[0]); ++i)
+		pthread_create(&workers[i].thread, NULL, workers[i].run, &workers[i]);
+
+	for (size_t i = 0; i < sizeof(workers) / sizeof(workers[0]); ++i) {
+		struct worker *worker = &workers[i];
+
+		pthread_join(worker->thread, NULL);
+
+		printf("%-18s %9lu ops (%8.0f/s) %9lu events (%8.0f/s) "
+		  "%7lu edges %5lu errors\n", worker->name,
+		  worker->ops, worker->ops / elapsed,
+		  worker->events, worker->events / elapsed,
+		  worker->edges, worker->errors);
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc == 5 && strcmp(argv[1], "pad") == 0)
+		return pad_main(argv[2], argv[3], argv[4]);
+
+	if (argc == 3 && strcmp(argv[1], "hammer") == 0)
+		return hammer_main(argv[2]);
+
+	fprintf(stderr,
+	  "usage: %s pad <wired|wireless|xbox1|xbox> <functionfs dir> <seconds>\n"
+	  "       %s hammer <seconds>\n", argv[0], argv[0]);
+
+	return 2;
+}
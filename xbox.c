@@ -0,0 +1,243 @@
+#include "xusb.h"
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/usb.h>
+
+MODULE_AUTHOR("Zachary Lund <admin@computerquip.com>");
+MODULE_DESCRIPTION("Original Xbox Controller Driver");
+MODULE_LICENSE("GPL");
+
+#define XBOX_PACKET_SIZE 32
+
+/* Anything over this on an analog face button counts as pressed. */
+#define XBOX_BUTTON_THRESHOLD 0x20
+
+static XINPUT_CAPABILITIES xbox_gamepad_caps = {
+	.Type = XINPUT_DEVTYPE_GAMEPAD,
+	.SubType = XINPUT_DEVSUBTYPE_GAMEPAD,
+	.Flags = XINPUT_CAPS_FFB_SUPPORTED,
+	.Gamepad = {
+		.wButtons =
+			XINPUT_GAMEPAD_DPAD_UP |
+			XINPUT_GAMEPAD_DPAD_DOWN |
+			XINPUT_GAMEPAD_DPAD_LEFT |
+			XINPUT_GAMEPAD_DPAD_RIGHT |
+			XINPUT_GAMEPAD_START |
+			XINPUT_GAMEPAD_BACK |
+			XINPUT_GAMEPAD_LEFT_THUMB |
+			XINPUT_GAMEPAD_RIGHT_THUMB |
+			XINPUT_GAMEPAD_LEFT_SHOULDER |
+			XINPUT_GAMEPAD_RIGHT_SHOULDER |
+			XINPUT_GAMEPAD_A |
+			XINPUT_GAMEPAD_B |
+			XINPUT_GAMEPAD_X |
+			XINPUT_GAMEPAD_Y,
+		.bLeftTrigger = 255,
+		.bRightTrigger = 255,
+		.sThumbLX = 32767,
+		.sThumbLY = 32767,
+		.sThumbRX = 32767,
+		.sThumbRY = 32767
+	},
+	.Vibration = {
+		.wLeftMotorSpeed = 65535,
+		.wRightMotorSpeed = 65535
+	}
+};
+
+static struct xusb_device xbox_devices[] = {
+	{
+		"Microsoft X-Box pad",
+		&xbox_gamepad_caps,
+		XUSB_DEVICE_ANALOG_BUTTONS
+	}
+};
+
+#define XBOX_DEVICE(vendor, product) \
+	USB_DEVICE_AND_INTERFACE_INFO(vendor, product, 0x58, 0x42, 0x00)
+
+static const struct usb_device_id xbox_table[] = {
+	{ XBOX_DEVICE(0x045E, 0x0202) }, /* Controller (Duke) */
+	{ XBOX_DEVICE(0x045E, 0x0285) }, /* Controller S (Japan) */
+	{ XBOX_DEVICE(0x045E, 0x0287) }, /* Controller S */
+	{ XBOX_DEVICE(0x045E, 0x0288) }, /* Controller S v2 */
+	{ XBOX_DEVICE(0x045E, 0x0289) }, /* Controller S (US) */
+	{}
+};
+
+struct xbox_context {
+	struct xusb_endpoint ep;
+	struct xusb_context *xusb_ctx;
+
+	struct usb_interface *usb_intf;
+};
+
+/* Only queues the packet. See xusb_endpoint_send(). */
+static int xbox_send(struct xbox_context *ctx,
+  enum xusb_out_kind kind, void *data, int size)
+{
+	return xusb_endpoint_send(&ctx->ep, kind, data, size);
+}
+
+static void xbox_set_vibration(
+  void *data, XINPUT_VIBRATION ff)
+{
+	struct xbox_context *ctx = data;
+
+	u8 packet[] = {
+		0x00, 0x06,
+		0x00, ff.wLeftMotorSpeed >> 8,
+		0x00, ff.wRightMotorSpeed >> 8
+	};
+
+	xbox_send(ctx, XUSB_OUT_RUMBLE, packet, sizeof(packet));
+}
+
+/* There's no LED on these, so no set_led. */
+static struct xusb_driver xbox_driver = {
+	.set_vibration = xbox_set_vibration
+};
+
+/* Parses straight out of the IN buffer into the xusb queue slot.
+   Black and white sit where the 360 puts its shoulder buttons, same
+   as the 360's own backwards compatibility does it. */
+static void xbox_parse_input(u8 *buffer, struct xusb_report *out)
+{
+	u16 buttons = 0;
+
+	if (buffer[0] & 0x01) buttons |= XINPUT_GAMEPAD_DPAD_UP;
+	if (buffer[0] & 0x02) buttons |= XINPUT_GAMEPAD_DPAD_DOWN;
+	if (buffer[0] & 0x04) buttons |= XINPUT_GAMEPAD_DPAD_LEFT;
+	if (buffer[0] & 0x08) buttons |= XINPUT_GAMEPAD_DPAD_RIGHT;
+	if (buffer[0] & 0x10) buttons |= XINPUT_GAMEPAD_START;
+	if (buffer[0] & 0x20) buttons |= XINPUT_GAMEPAD_BACK;
+	if (buffer[0] & 0x40) buttons |= XINPUT_GAMEPAD_LEFT_THUMB;
+	if (buffer[0] & 0x80) buttons |= XINPUT_GAMEPAD_RIGHT_THUMB;
+
+	if (buffer[2] > XBOX_BUTTON_THRESHOLD) buttons |= XINPUT_GAMEPAD_A;
+	if (buffer[3] > XBOX_BUTTON_THRESHOLD) buttons |= XINPUT_GAMEPAD_B;
+	if (buffer[4] > XBOX_BUTTON_THRESHOLD) buttons |= XINPUT_GAMEPAD_X;
+	if (buffer[5] > XBOX_BUTTON_THRESHOLD) buttons |= XINPUT_GAMEPAD_Y;
+	if (buffer[6] > XBOX_BUTTON_THRESHOLD)
+		buttons |= XINPUT_GAMEPAD_RIGHT_SHOULDER;
+	if (buffer[7] > XBOX_BUTTON_THRESHOLD)
+		buttons |= XINPUT_GAMEPAD_LEFT_SHOULDER;
+
+	out->Gamepad.wButtons = buttons;
+
+	out->bAnalogButtons[XUSB_ANALOG_A] = buffer[2];
+	out->bAnalogButtons[XUSB_ANALOG_B] = buffer[3];
+	out->bAnalogButtons[XUSB_ANALOG_X] = buffer[4];
+	out->bAnalogButtons[XUSB_ANALOG_Y] = buffer[5];
+	out->bAnalogButtons[XUSB_ANALOG_BLACK] = buffer[6];
+	out->bAnalogButtons[XUSB_ANALOG_WHITE] = buffer[7];
+
+	out->Gamepad.bLeftTrigger = buffer[8];
+	out->Gamepad.bRightTrigger = buffer[9];
+	out->Gamepad.sThumbLX = (__s16)le16_to_cpup((__le16*)&buffer[10]);
+	out->Gamepad.sThumbLY = (__s16)le16_to_cpup((__le16*)&buffer[12]);
+	out->Gamepad.sThumbRX = (__s16)le16_to_cpup((__le16*)&buffer[14]);
+	out->Gamepad.sThumbRY = (__s16)le16_to_cpup((__le16*)&buffer[16]);
+}
+
+/* Called from the IN endpoint's completion handler. */
+static void xbox_receive(void *context, u8 *data, u32 length,
+  ktime_t timestamp)
+{
+	struct xbox_context *ctx = context;
+	struct xusb_report *report;
+
+	/* Pairs with xbox_probe(). */
+	struct xusb_context *xusb_ctx = smp_load_acquire(&ctx->xusb_ctx);
+
+	/* Started polling before registering; see probe. */
+	if (!xusb_ctx)
+		return;
+
+	/* Only one kind of packet: 0x00, length (0x14), payload. */
+	if (length < 20 || data[0] != 0x00 || data[1] != 0x14)
+		return;
+
+	report = xusb_begin_report(xusb_ctx);
+	if (!report)
+		return;
+
+	xbox_parse_input(&data[2], report);
+	xusb_commit_report(xusb_ctx, timestamp);
+}
+
+static int xbox_probe(struct usb_interface *intf,
+	const struct usb_device_id *id)
+{
+	struct xbox_context *ctx;
+	struct xusb_context *xusb_ctx;
+
+	int error = 0;
+
+	ctx = kmalloc(sizeof(struct xbox_context), GFP_KERNEL);
+
+	if (!ctx) {
+		return -ENOMEM;
+	}
+
+	ctx->usb_intf = intf;
+	ctx->xusb_ctx = 0;
+
+	error = xusb_endpoint_init(&ctx->ep, intf,
+	  XBOX_PACKET_SIZE, xbox_receive, ctx);
+
+	if (error)
+		goto fail_endpoint;
+
+	/* Started first so anything sent once registered has an
+	   endpoint to go out on. Input seen before the context is
+	   published below is dropped. */
+	error = xusb_endpoint_start(&ctx->ep);
+	if (error)
+		goto fail_in_submit;
+
+	xusb_ctx =
+	  xusb_register_device(
+	    &ctx->ep, &xbox_driver,
+	    &xbox_devices[0], ctx);
+
+	smp_store_release(&ctx->xusb_ctx, xusb_ctx);
+
+	if (!xusb_ctx) {
+		error = -ENODEV;
+		goto fail_in_submit;
+	}
+
+	return 0;
+
+fail_in_submit:
+	xusb_endpoint_destroy(&ctx->ep);
+fail_endpoint:
+	kfree(ctx);
+
+	return error;
+}
+
+static void xbox_disconnect(struct usb_interface *intf)
+{
+	struct xbox_context *ctx =
+	  container_of(usb_get_intfdata(intf), struct xbox_context, ep);
+
+	xusb_endpoint_destroy(&ctx->ep);
+	xusb_unregister_device(ctx->xusb_ctx);
+
+	xusb_flush();
+
+	kfree(ctx);
+}
+
+static struct usb_driver xbox_usb_driver = {
+	.name = "xbox",
+	.id_table = xbox_table,
+	.probe = xbox_probe,
+	.disconnect = xbox_disconnect,
+	.dev_groups = xusb_endpoint_groups,
+	.soft_unbind = 1
+};
+
+module_usb_driver(xbox_usb_driver);
@@ -0,0 +1,395 @@
+#include "xusb.h"
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/usb.h>
+
+MODULE_AUTHOR("Zachary Lund <admin@computerquip.com>");
+MODULE_DESCRIPTION("Xbox One Controller Driver");
+MODULE_LICENSE("GPL");
+
+#define XBOX1_PACKET_SIZE 64
+
+/* The Xbox One pads speak GIP. Every packet starts with the same
+   four byte header: command, options, sequence number and payload
+   length. Most of what we know comes from watching the Windows
+   driver, same as the 360 pads. */
+#define GIP_CMD_ACK             0x01
+#define GIP_CMD_ANNOUNCE        0x02
+#define GIP_CMD_HEARTBEAT       0x03
+#define GIP_CMD_POWER           0x05
+#define GIP_CMD_VIRTUAL_KEY     0x07
+#define GIP_CMD_RUMBLE          0x09
+#define GIP_CMD_LED             0x0A
+#define GIP_CMD_INPUT           0x20
+
+#define GIP_OPT_ACK             0x10
+#define GIP_OPT_INTERNAL        0x20
+
+#define GIP_POWER_ON            0x00
+#define GIP_MOTOR_ALL           0x0F
+
+#define GIP_LED_OFF             0x00
+#define GIP_LED_ON              0x01
+
+/* Needs an extra packet after power on before it sends input. */
+#define XBOX1_QUIRK_S_INIT      0x01
+
+static XINPUT_CAPABILITIES xbox1_gamepad_caps = {
+	.Type = XINPUT_DEVTYPE_GAMEPAD,
+	.SubType = XINPUT_DEVSUBTYPE_GAMEPAD,
+	.Flags = XINPUT_CAPS_FFB_SUPPORTED,
+	.Gamepad = {
+		.wButtons =
+			XINPUT_GAMEPAD_DPAD_UP |
+			XINPUT_GAMEPAD_DPAD_DOWN |
+			XINPUT_GAMEPAD_DPAD_LEFT |
+			XINPUT_GAMEPAD_DPAD_RIGHT |
+			XINPUT_GAMEPAD_START |
+			XINPUT_GAMEPAD_BACK |
+			XINPUT_GAMEPAD_LEFT_THUMB |
+			XINPUT_GAMEPAD_RIGHT_THUMB |
+			XINPUT_GAMEPAD_LEFT_SHOULDER |
+			XINPUT_GAMEPAD_RIGHT_SHOULDER |
+			XINPUT_GAMEPAD_GUIDE |
+			XINPUT_GAMEPAD_A |
+			XINPUT_GAMEPAD_B |
+			XINPUT_GAMEPAD_X |
+			XINPUT_GAMEPAD_Y,
+		.bLeftTrigger = 255,
+		.bRightTrigger = 255,
+		.sThumbLX = 32767,
+		.sThumbLY = 32767,
+		.sThumbRX = 32767,
+		.sThumbRY = 32767
+	},
+	.Vibration = {
+		.wLeftMotorSpeed = 65535,
+		.wRightMotorSpeed = 65535
+	}
+};
+
+static struct xusb_device xbox1_devices[] = {
+	{
+		"Microsoft X-Box One pad",
+		&xbox1_gamepad_caps
+	}
+};
+
+#define XBOX1_DEVICE(product, quirks) \
+	USB_DEVICE_AND_INTERFACE_INFO(0x045E, product, 0xFF, 0x47, 0xD0), \
+	.driver_info = quirks
+
+static const struct usb_device_id xbox1_table[] = {
+	{ XBOX1_DEVICE(0x02D1, 0) },                    /* Xbox One */
+	{ XBOX1_DEVICE(0x02DD, 0) },                    /* Xbox One (2015) */
+	{ XBOX1_DEVICE(0x02E3, 0) },                    /* Elite */
+	{ XBOX1_DEVICE(0x02EA, XBOX1_QUIRK_S_INIT) },   /* Xbox One S */
+	{ XBOX1_DEVICE(0x0B00, XBOX1_QUIRK_S_INIT) },   /* Elite Series 2 */
+	{ XBOX1_DEVICE(0x0B12, XBOX1_QUIRK_S_INIT) },   /* Series X|S */
+	{}
+};
+
+struct xbox1_context {
+	struct xusb_endpoint ep;
+	struct xusb_context *xusb_ctx;
+
+	struct usb_interface *usb_intf;
+	unsigned long quirks;
+
+	/* Outgoing sequence number. Any context may send. */
+	atomic_t seq;
+
+	/* Only touched from the completion handler. */
+	XINPUT_GAMEPAD last; /* Guide is reported separately */
+	int last_input_seq;
+	int last_guide_seq;
+
+	/* Rumble and trigger rumble share a packet. */
+	spinlock_t rumble_lock;
+	XINPUT_VIBRATION rumble;
+	XINPUT_VIBRATION trigger_rumble;
+};
+
+/* Stamps the sequence number and queues the packet.
+   Only queues the packet. See xusb_endpoint_send(). */
+static int xbox1_send(struct xbox1_context *ctx,
+  enum xusb_out_kind kind, u8 *data, int size)
+{
+	data[2] = (u8)atomic_inc_return(&ctx->seq);
+
+	return xusb_endpoint_send(&ctx->ep, kind, data, size);
+}
+
+/* Reports with GIP_OPT_ACK set are resent until acknowledged.
+   The ack echoes their sequence number rather than using ours. */
+static void xbox1_send_ack(struct xbox1_context *ctx, const u8 *data)
+{
+	u8 packet[] = {
+		GIP_CMD_ACK, GIP_OPT_INTERNAL, data[2], 0x09,
+		0x00, data[0], GIP_OPT_INTERNAL, data[3],
+		0x00, 0x00, 0x00, 0x00, 0x00
+	};
+
+	xusb_endpoint_send(&ctx->ep, XUSB_OUT_COMMAND, packet, sizeof(packet));
+}
+
+/* Nothing here waits for a reply. The pad starts sending input
+   once it has seen these, whenever that ends up being. */
+static void xbox1_power_on(struct xbox1_context *ctx)
+{
+	u8 power_on[] = {
+		GIP_CMD_POWER, GIP_OPT_INTERNAL, 0x00, 0x01, GIP_POWER_ON
+	};
+
+	u8 s_init[] = {
+		GIP_CMD_POWER, GIP_OPT_INTERNAL, 0x00, 0x0F, 0x06
+	};
+
+	xbox1_send(ctx, XUSB_OUT_COMMAND, power_on, sizeof(power_on));
+
+	if (ctx->quirks & XBOX1_QUIRK_S_INIT)
+		xbox1_send(ctx, XUSB_OUT_COMMAND, s_init, sizeof(s_init));
+}
+
+/* Motors take 0-100ish. Triggers and both main motors always go out
+   together so setting one mustn't clobber the other. */
+static void xbox1_send_rumble(struct xbox1_context *ctx,
+  const XINPUT_VIBRATION *rumble, const XINPUT_VIBRATION *trigger_rumble)
+{
+	unsigned long flags;
+
+	u8 packet[] = {
+		GIP_CMD_RUMBLE, 0x00, 0x00, 0x09,
+		0x00, GIP_MOTOR_ALL,
+		0x00, 0x00, 0x00, 0x00, /* LT, RT, strong, weak */
+		0xFF, 0x00, 0xFF /* Duration, delay, repeat */
+	};
+
+	spin_lock_irqsave(&ctx->rumble_lock, flags);
+
+	if (rumble)
+		ctx->rumble = *rumble;
+
+	if (trigger_rumble)
+		ctx->trigger_rumble = *trigger_rumble;
+
+	packet[6] = ctx->trigger_rumble.wLeftMotorSpeed >> 9;
+	packet[7] = ctx->trigger_rumble.wRightMotorSpeed >> 9;
+	packet[8] = ctx->rumble.wLeftMotorSpeed >> 9;
+	packet[9] = ctx->rumble.wRightMotorSpeed >> 9;
+
+	xbox1_send(ctx, XUSB_OUT_RUMBLE, packet, sizeof(packet));
+
+	spin_unlock_irqrestore(&ctx->rumble_lock, flags);
+}
+
+static void xbox1_set_vibration(
+  void *data, XINPUT_VIBRATION ff)
+{
+	xbox1_send_rumble(data, &ff, NULL);
+}
+
+static void xbox1_set_trigger_vibration(
+  void *data, XINPUT_VIBRATION ff)
+{
+	xbox1_send_rumble(data, NULL, &ff);
+}
+
+/* The only LED is the guide button. Anything but off is on. */
+static void xbox1_set_led(
+  void *data, enum XINPUT_LED_STATUS led_status)
+{
+	struct xbox1_context *ctx = data;
+
+	u8 packet[] = {
+		GIP_CMD_LED, GIP_OPT_INTERNAL, 0x00, 0x03,
+		0x00,
+		led_status == XINPUT_LED_OFF ? GIP_LED_OFF : GIP_LED_ON,
+		0x14 /* Brightness */
+	};
+
+	xbox1_send(ctx, XUSB_OUT_LED, packet, sizeof(packet));
+}
+
+static struct xusb_driver xbox1_driver = {
+	.set_led = xbox1_set_led,
+	.set_vibration = xbox1_set_vibration,
+	.set_trigger_vibration = xbox1_set_trigger_vibration
+};
+
+/* Parses straight out of the IN buffer. Guide isn't part of this
+   report so it's carried over from what we last saw. */
+static void xbox1_parse_input(u8 *buffer, u16 guide, PXINPUT_GAMEPAD out)
+{
+	u16 buttons = guide;
+
+	if (buffer[0] & 0x04) buttons |= XINPUT_GAMEPAD_START;
+	if (buffer[0] & 0x08) buttons |= XINPUT_GAMEPAD_BACK;
+	if (buffer[0] & 0x10) buttons |= XINPUT_GAMEPAD_A;
+	if (buffer[0] & 0x20) buttons |= XINPUT_GAMEPAD_B;
+	if (buffer[0] & 0x40) buttons |= XINPUT_GAMEPAD_X;
+	if (buffer[0] & 0x80) buttons |= XINPUT_GAMEPAD_Y;
+
+	if (buffer[1] & 0x01) buttons |= XINPUT_GAMEPAD_DPAD_UP;
+	if (buffer[1] & 0x02) buttons |= XINPUT_GAMEPAD_DPAD_DOWN;
+	if (buffer[1] & 0x04) buttons |= XINPUT_GAMEPAD_DPAD_LEFT;
+	if (buffer[1] & 0x08) buttons |= XINPUT_GAMEPAD_DPAD_RIGHT;
+	if (buffer[1] & 0x10) buttons |= XINPUT_GAMEPAD_LEFT_SHOULDER;
+	if (buffer[1] & 0x20) buttons |= XINPUT_GAMEPAD_RIGHT_SHOULDER;
+	if (buffer[1] & 0x40) buttons |= XINPUT_GAMEPAD_LEFT_THUMB;
+	if (buffer[1] & 0x80) buttons |= XINPUT_GAMEPAD_RIGHT_THUMB;
+
+	out->wButtons = buttons;
+
+	/* Triggers are 10 bit. */
+	out->bLeftTrigger = le16_to_cpup((__le16*)&buffer[2]) >> 2;
+	out->bRightTrigger = le16_to_cpup((__le16*)&buffer[4]) >> 2;
+	out->sThumbLX = (__s16)le16_to_cpup((__le16*)&buffer[6]);
+	out->sThumbLY = (__s16)le16_to_cpup((__le16*)&buffer[8]);
+	out->sThumbRX = (__s16)le16_to_cpup((__le16*)&buffer[10]);
+	out->sThumbRY = (__s16)le16_to_cpup((__le16*)&buffer[12]);
+}
+
+/* Called from the IN endpoint's completion handler. */
+static void xbox1_receive(void *context, u8 *data, u32 length,
+  ktime_t timestamp)
+{
+	struct xbox1_context *ctx = context;
+
+	/* Pairs with xbox1_probe(). */
+	struct xusb_context *xusb_ctx = smp_load_acquire(&ctx->xusb_ctx);
+
+	if (length < 4)
+		return;
+
+	if (data[1] & GIP_OPT_ACK)
+		xbox1_send_ack(ctx, data);
+
+	switch (data[0]) {
+	case GIP_CMD_ANNOUNCE:
+		/* Sent on connect and whenever the pad resets.
+		   It won't send input again until powered on. */
+		xbox1_power_on(ctx);
+		break;
+
+	case GIP_CMD_HEARTBEAT:
+		break;
+
+	case GIP_CMD_VIRTUAL_KEY:
+		/* Resent with the same sequence number until acked. */
+		if (length < 5 || data[2] == ctx->last_guide_seq)
+			break;
+
+		ctx->last_guide_seq = data[2];
+
+		if (data[4] & 0x03)
+			ctx->last.wButtons |= XINPUT_GAMEPAD_GUIDE;
+		else
+			ctx->last.wButtons &= ~XINPUT_GAMEPAD_GUIDE;
+
+		if (xusb_ctx)
+			xusb_report_input(xusb_ctx, &ctx->last, timestamp);
+
+		break;
+
+	case GIP_CMD_INPUT:
+		if (length < 18 || data[2] == ctx->last_input_seq)
+			break;
+
+		ctx->last_input_seq = data[2];
+
+		xbox1_parse_input(&data[4],
+		  ctx->last.wButtons & XINPUT_GAMEPAD_GUIDE, &ctx->last);
+
+		if (xusb_ctx)
+			xusb_report_input(xusb_ctx, &ctx->last, timestamp);
+
+		break;
+
+	default:
+		xusb_endpoint_unknown(&ctx->ep, data[0]);
+	}
+}
+
+static int xbox1_probe(struct usb_interface *intf,
+	const struct usb_device_id *id)
+{
+	struct xbox1_context *ctx;
+	struct xusb_context *xusb_ctx;
+
+	int error = 0;
+
+	ctx = kzalloc(sizeof(struct xbox1_context), GFP_KERNEL);
+
+	if (!ctx) {
+		return -ENOMEM;
+	}
+
+	ctx->usb_intf = intf;
+	ctx->quirks = id->driver_info;
+	ctx->last_input_seq = -1;
+	ctx->last_guide_seq = -1;
+	atomic_set(&ctx->seq, 0);
+	spin_lock_init(&ctx->rumble_lock);
+
+	error = xusb_endpoint_init(&ctx->ep, intf,
+	  XBOX1_PACKET_SIZE, xbox1_receive, ctx);
+
+	if (error)
+		goto fail_endpoint;
+
+	/* Started first so the LED set on registering isn't turned
+	   away. Input seen before the context is published below is
+	   dropped; the pad sends none until powered on anyway. */
+	error = xusb_endpoint_start(&ctx->ep);
+	if (error)
+		goto fail_in_submit;
+
+	xusb_ctx =
+	  xusb_register_device(
+	    &ctx->ep, &xbox1_driver,
+	    &xbox1_devices[0], ctx);
+
+	smp_store_release(&ctx->xusb_ctx, xusb_ctx);
+
+	if (!xusb_ctx) {
+		error = -ENODEV;
+		goto fail_in_submit;
+	}
+
+	/* Unlike the 360 pads, these stay quiet until told otherwise. */
+	xbox1_power_on(ctx);
+
+	return 0;
+
+fail_in_submit:
+	xusb_endpoint_destroy(&ctx->ep);
+fail_endpoint:
+	kfree(ctx);
+
+	return error;
+}
+
+static void xbox1_disconnect(struct usb_interface *intf)
+{
+	struct xbox1_context *ctx =
+	  container_of(usb_get_intfdata(intf), struct xbox1_context, ep);
+
+	xusb_endpoint_destroy(&ctx->ep);
+	xusb_unregister_device(ctx->xusb_ctx);
+
+	xusb_flush();
+
+	kfree(ctx);
+}
+
+static struct usb_driver xbox1_usb_driver = {
+	.name = "xbox1",
+	.id_table = xbox1_table,
+	.probe = xbox1_probe,
+	.disconnect = xbox1_disconnect,
+	.dev_groups = xusb_endpoint_groups,
+	.soft_unbind = 1
+};
+
+module_usb_driver(xbox1_usb_driver);
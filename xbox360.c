@@ -10,11 +10,10 @@ MODULE_LICENSE("GPL");
 #define XBOX360_PACKET_SIZE 32
 
 struct xbox360_context {
+	struct xusb_endpoint ep;
 	struct xusb_context *xusb_ctx;
 
 	struct usb_interface *usb_intf;
-	struct urb *in;
-	int pipe_out;
 };
 
 static XINPUT_CAPABILITIES xbox360_gamepad_caps = {
@@ -63,30 +62,26 @@ static struct usb_device_id xbox360_table[] = {
 	{}
 };
 
-static int xbox360_send(struct xbox360_context *ctx, void *data, int size)
+/* Only queues the packet. See xusb_endpoint_send(). */
+static int xbox360_send(struct xbox360_context *ctx,
+  enum xusb_out_kind kind, void *data, int size)
 {
-	struct usb_device *usb_dev = interface_to_usbdev(ctx->usb_intf);
-	int actual_length = 0;
-	int error;
-
-	if (usb_dev->state == USB_STATE_NOTATTACHED)
-		return 0;
-
-	error = usb_interrupt_msg(usb_dev, ctx->pipe_out,
-	  data, size, &actual_length, 0);
-
-	if (error) {
-		printk(KERN_ERR "Error during submission."
-		"Error code: %d - Actual Length %d\n", error, actual_length);
-	}
-
-	return actual_length;
+	return xusb_endpoint_send(&ctx->ep, kind, data, size);
 }
 
 static void xbox360_set_vibration(
   void *data, XINPUT_VIBRATION ff)
 {
-	printk(KERN_INFO "Setting vibration!\n");
+	struct xbox360_context *ctx = data;
+
+	u8 packet[] = {
+		0x00, 0x08, 0x00,
+		ff.wLeftMotorSpeed >> 8,
+		ff.wRightMotorSpeed >> 8,
+		0x00, 0x00, 0x00
+	};
+
+	xbox360_send(ctx, XUSB_OUT_RUMBLE, packet, sizeof(packet));
 }
 
 static void xbox360_set_led(
@@ -96,7 +91,7 @@ static void xbox360_set_led(
 
 	u8 packet[] = { 0x01, 0x03, led_status };
 
-	xbox360_send(ctx, packet, sizeof(packet));
+	xbox360_send(ctx, XUSB_OUT_LED, packet, sizeof(packet));
 }
 
 static void xpad360_parse_input(void *data, PXINPUT_GAMEPAD out)
@@ -112,22 +107,14 @@ static void xpad360_parse_input(void *data, PXINPUT_GAMEPAD out)
 	out->sThumbRY = (__s16)le16_to_cpup((__le16*)&buffer[10]);
 }
 
-/* Interrupt for incoming URB.  */
-static void xbox360_receive(struct urb* urb)
+/* Called from the IN endpoint's completion handler. */
+static void xbox360_receive(void *context, u8 *data, u32 length,
+  ktime_t timestamp)
 {
-	struct xbox360_context *context = urb->context;
-	u8 *data = urb->transfer_buffer;
+	struct xbox360_context *ctx = context;
 
-	switch (urb->status) {
-	case 0:
-		break;
-	case -ECONNRESET:
-	case -ENOENT:
-	case -ESHUTDOWN:
-		return;
-	default:
-		goto finish;
-	}
+	/* Pairs with xbox360_probe(). */
+	struct xusb_context *xusb_ctx = smp_load_acquire(&ctx->xusb_ctx);
 
 	/* Packets arrive respective to how the switch is laid out. */
 	switch(le16_to_cpup((u16*)&data[0])) {
@@ -137,17 +124,28 @@ static void xbox360_receive(struct urb* urb)
 	case 0x0303: /* Unknown! */
 		break;
 	case 0x0308: /* Attachment */
+		/* Plugging in a chatpad sends one of these, but its keys
+		   come in over another interface and need control
+		   transfers to wake it up. Only wireless does chatpads. */
 		break;
 	case 0x1400: {
-		XINPUT_GAMEPAD input;
-		xpad360_parse_input(&data[2], &input);
-		xusb_report_input(context->xusb_ctx, &input);
+		struct xusb_report *report;
+
+		/* Started polling before registering; see probe. */
+		if (!xusb_ctx)
+			break;
+
+		report = xusb_begin_report(xusb_ctx);
+		if (!report)
+			break;
+
+		xpad360_parse_input(&data[2], &report->Gamepad);
+		xusb_commit_report(xusb_ctx, timestamp);
 		break;
 	}
+	default:
+		xusb_endpoint_unknown(&ctx->ep, le16_to_cpup((u16*)&data[0]));
 	}
-
-finish:
-	usb_submit_urb(urb, GFP_ATOMIC);
 }
 
 static struct xusb_driver xbox360_driver = {
@@ -158,16 +156,10 @@ static struct xusb_driver xbox360_driver = {
 static int xbox360_probe(struct usb_interface *intf,
 	const struct usb_device_id *id)
 {
-	struct usb_device *usb_dev = interface_to_usbdev(intf);
-	struct usb_endpoint_descriptor *ep =
-		&intf->cur_altsetting->endpoint[0].desc;
-
-	const int pipe = usb_rcvintpipe(usb_dev, ep->bEndpointAddress);
 	struct xbox360_context *ctx;
+	struct xusb_context *xusb_ctx;
 
 	int error = 0;
-	void *in_buffer;
-	dma_addr_t in_dma;
 
 	ctx = kmalloc(sizeof(struct xbox360_context), GFP_KERNEL);
 
@@ -175,58 +167,41 @@ static int xbox360_probe(struct usb_interface *intf,
 		return -ENOMEM;
 	}
 
-	usb_set_intfdata(intf, ctx);
 	ctx->usb_intf = intf;
-	ctx->pipe_out =
-	  usb_sndintpipe(usb_dev,
-	    intf->cur_altsetting->endpoint[1].desc.bEndpointAddress);
-
-	ctx->in = usb_alloc_urb(0, GFP_KERNEL);
-	if (!ctx->in) {
-		error = -ENOMEM;
-		goto fail_urb_alloc;
-	}
+	ctx->xusb_ctx = 0;
 
-	in_buffer =
-	usb_alloc_coherent(
-		usb_dev, XBOX360_PACKET_SIZE,
-		GFP_KERNEL, &in_dma);
+	error = xusb_endpoint_init(&ctx->ep, intf,
+	  XBOX360_PACKET_SIZE, xbox360_receive, ctx);
 
-	if (!in_buffer) {
-		error = -ENOMEM;
-		goto fail_alloc_coherent;
-	}
+	if (error)
+		goto fail_endpoint;
 
-	usb_fill_int_urb(
-		ctx->in, usb_dev,
-		pipe, in_buffer, XBOX360_PACKET_SIZE,
-		xbox360_receive, ctx, ep->bInterval);
-
-	error = usb_submit_urb(ctx->in, GFP_KERNEL);
+	/* Started first so the player LED set on registering isn't
+	   turned away. Input seen before the context is published
+	   below is dropped. */
+	error = xusb_endpoint_start(&ctx->ep);
 	if (error) {
 		error = -ENOMEM;
 		goto fail_in_submit;
 	}
 
-	ctx->xusb_ctx =
+	xusb_ctx =
 	  xusb_register_device(
-	    &xbox360_driver,
+	    &ctx->ep, &xbox360_driver,
 	    &xbox360_devices[id - xbox360_table], ctx);
 
-	if (ctx->xusb_ctx < 0) {
+	smp_store_release(&ctx->xusb_ctx, xusb_ctx);
+
+	if (!xusb_ctx) {
 		error = -ENODEV;
-		goto fail_xusb;
+		goto fail_in_submit;
 	}
 
 	return 0;
 
-fail_xusb:
-	usb_kill_urb(ctx->in);
 fail_in_submit:
-	usb_free_coherent(usb_dev, XBOX360_PACKET_SIZE, in_buffer, in_dma);
-fail_alloc_coherent:
-	usb_free_urb(ctx->in);
-fail_urb_alloc:
+	xusb_endpoint_destroy(&ctx->ep);
+fail_endpoint:
 	kfree(ctx);
 
 	return error;
@@ -234,17 +209,11 @@ fail_urb_alloc:
 
 static void xbox360_disconnect(struct usb_interface *intf)
 {
-	struct xbox360_context *ctx = usb_get_intfdata(intf);
-	struct usb_device *usb_dev = interface_to_usbdev(intf);
-	struct urb *in_urb = ctx->in;
-
-	usb_kill_urb(in_urb);
-	usb_free_coherent(usb_dev, XBOX360_PACKET_SIZE,
-	  in_urb->transfer_buffer, in_urb->transfer_dma);
-	usb_free_urb(in_urb);
-	xusb_unregister_device(ctx->xusb_ctx);
+	struct xbox360_context *ctx =
+	  container_of(usb_get_intfdata(intf), struct xbox360_context, ep);
 
-	xbox360_set_led(ctx, XINPUT_LED_ROTATING);
+	xusb_endpoint_destroy(&ctx->ep);
+	xusb_unregister_device(ctx->xusb_ctx);
 
 	xusb_flush();
 
@@ -256,6 +225,7 @@ static struct usb_driver xbox360_usb_driver = {
 	.id_table = xbox360_table,
 	.probe = xbox360_probe,
 	.disconnect = xbox360_disconnect,
+	.dev_groups = xusb_endpoint_groups,
 	.soft_unbind = 1
 };
 
@@ -2,6 +2,8 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/usb.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
 
 MODULE_AUTHOR("Zachary Lund <admin@computerquip.com>");
 MODULE_DESCRIPTION("Xbox 360 Wireless Adapter Driver");
@@ -9,6 +11,16 @@ MODULE_LICENSE("GPL");
 
 #define XBOX360WR_PACKET_SIZE 32
 
+/* Idle pads still send their 0x01F8/0x02F8 pairs, and halfway
+   through we ask the adapter, which answers for a pad it still
+   has. Three seconds of neither is a pad that's gone. */
+static unsigned int link_timeout_ms = 3000;
+module_param(link_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(link_timeout_ms,
+  "Consider a controller gone after this long without hearing from it, "
+  "instead of waiting for the adapter to say so. 0 disables. "
+  "Default 3000.");
+
 static XINPUT_CAPABILITIES xbox360wr_gamepad_caps = {
 	.Type = XINPUT_DEVTYPE_GAMEPAD,
 	.SubType = XINPUT_DEVSUBTYPE_GAMEPAD,
@@ -58,12 +70,55 @@ static struct xusb_device xbox360wr_devices[] = {
 	}
 };
 
+/* Link quality, all of it guarded by the context's lock. The pad
+   sends 0x01F8 and then 0x02F8 every so often even when idle. We
+   don't know what's in them, but the gaps between packets and
+   whether the pair arrives complete say plenty about the link. The
+   presence query gets answered by the adapter itself, so its round
+   trip covers the USB side and the adapter but not the radio. */
+struct xbox360wr_link {
+	ktime_t last_rx;        /* Last packet from the controller */
+	ktime_t last_alive;     /* Same, or the adapter saying it's there */
+	u64 gap_ns;             /* Moving average between those */
+	u64 gap_max_ns;
+
+	ktime_t query_sent;     /* 0 if no presence query is outstanding */
+	u64 rtt_ns;
+
+	bool ping_answered;
+	unsigned long pings;
+	unsigned long missed_pings;
+	unsigned long timeouts;
+
+	/* Timed out on our end; the next packet from it resyncs. */
+	bool lost;
+
+	struct hrtimer timer;
+	bool timer_running;
+
+	/* Unregistering is left to timeout_work rather than done
+	   from the timer. */
+	struct xusb_context *timed_out;
+	struct work_struct timeout_work;
+};
+
 struct xbox360wr_context {
+	struct xusb_endpoint ep;
+
+	/* Changed by both the completion handler and the link timer. */
+	spinlock_t lock;
 	struct xusb_context *xusb_ctx;
+	struct xbox360wr_link link;
+
+	/* Something is plugged into the pad, going by the adapter. If
+	   it's a chatpad, it goes back to sleep without a keepalive
+	   every second, which starts once it first sends us keys. */
+	bool attachment;
+	struct hrtimer chatpad_timer;
+	bool chatpad_attached;
+	bool chatpad_toggle;
 
 	struct usb_interface *usb_intf;
-	struct urb *in;
-	int pipe_out; /* I don't like the pipe... */
 };
 
 /* There's a lot of oddities with the outward packets.
@@ -71,23 +126,11 @@ struct xbox360wr_context {
    They're just from observing the packets from the
    Microsoft driver */
 
-static int xbox360wr_send(struct xbox360wr_context *ctx, void *data, int size)
+/* Only queues the packet. See xusb_endpoint_send(). */
+static int xbox360wr_send(struct xbox360wr_context *ctx,
+  enum xusb_out_kind kind, void *data, int size)
 {
-	struct usb_device *usb_dev = interface_to_usbdev(ctx->usb_intf);
-	int actual_length = 0, error;
-
-	if (usb_dev->state == USB_STATE_NOTATTACHED)
-		return 0;
-
-	error = usb_interrupt_msg(usb_dev, ctx->pipe_out,
-	  data, size, &actual_length, 0);
-
-	if (error) {
-		printk(KERN_ERR "Error during submission."
-		"Error code: %d - Actual Length %d\n", error, actual_length);
-	}
-
-	return actual_length;
+	return xusb_endpoint_send(&ctx->ep, kind, data, size);
 }
 
 static void xbox360wr_set_vibration(
@@ -104,7 +147,7 @@ static void xbox360wr_set_vibration(
 		0x00, 0x00,  0x00, 0x00
 	};
 
-	xbox360wr_send(ctx, packet, sizeof(packet));
+	xbox360wr_send(ctx, XUSB_OUT_RUMBLE, packet, sizeof(packet));
 }
 
 /* While this does seem to effectively set the LED,
@@ -122,31 +165,173 @@ static void xbox360wr_set_led(
 		0x00, 0x00, 0x00, 0x00, 0x00, 0x00
 	};
 
-	xbox360wr_send(ctx, packet, sizeof(packet));
+	xbox360wr_send(ctx, XUSB_OUT_LED, packet, sizeof(packet));
 }
 
 static void xbox360wr_query_presence(struct xbox360wr_context *ctx)
 {
 #define PRESENCE_PACKET_SIZE 12
-	int actual_length, error;
-	struct usb_device *usb_dev = interface_to_usbdev(ctx->usb_intf);
-
 	u8 packet[PRESENCE_PACKET_SIZE] = {
 		0x08, 0x00, 0x0F, 0xC0,
 		0x00, 0x00, 0x00, 0x00,
 		0x00, 0x00, 0x00, 0x00
 	};
 
-	error =
-	  usb_interrupt_msg(usb_dev, ctx->pipe_out,
-	    packet, PRESENCE_PACKET_SIZE, &actual_length, 0);
+	/* Can't really do anything if this fails... */
+	if (xbox360wr_send(ctx, XUSB_OUT_COMMAND,
+	    packet, PRESENCE_PACKET_SIZE) == 0)
+		ctx->link.query_sent = ktime_get();
+}
 
-	if (error) {
-		printk(KERN_ERR "Error during submission."
-		  "Error code: %d - Actual Length %d\n", error, actual_length);
+/* Chatpad commands. Nobody outside Microsoft knows what these mean,
+   only that the chatpad stays quiet without them. */
+static void xbox360wr_chatpad_command(struct xbox360wr_context *ctx, u8 command)
+{
+	u8 packet[] = { 0x00, 0x00, 0x0C, command };
+
+	xbox360wr_send(ctx, XUSB_OUT_COMMAND, packet, sizeof(packet));
+}
+
+static enum hrtimer_restart xbox360wr_chatpad_timer(struct hrtimer *timer)
+{
+	struct xbox360wr_context *ctx =
+	  container_of(timer, struct xbox360wr_context, chatpad_timer);
+
+	enum hrtimer_restart restart = HRTIMER_NORESTART;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->lock, flags);
+
+	/* Stops along with the pad or the chatpad. */
+	if (!ctx->xusb_ctx || !ctx->chatpad_attached)
+		goto out;
+
+	ctx->chatpad_toggle = !ctx->chatpad_toggle;
+	xbox360wr_chatpad_command(ctx, ctx->chatpad_toggle ? 0x1F : 0x1E);
+
+	hrtimer_forward_now(timer, ms_to_ktime(1000));
+	restart = HRTIMER_RESTART;
+
+out:
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	return restart;
+}
+
+/* Must be called with ctx->lock held, while the pad is registered.
+   The chatpad needs 0x1B before it sends anything, so that goes to
+   anything plugged in; a headset doesn't seem to mind. */
+static void xbox360wr_update_attachment(struct xbox360wr_context *ctx,
+  bool attachment)
+{
+	lockdep_assert_held(&ctx->lock);
+
+	if (attachment == ctx->attachment)
+		return;
+
+	ctx->attachment = attachment;
+
+	if (attachment) {
+		xbox360wr_chatpad_command(ctx, 0x1B);
+		return;
+	}
+
+	/* Unplugged. The keepalive stops on its own. */
+	if (ctx->chatpad_attached) {
+		ctx->chatpad_attached = false;
+		xusb_attach_chatpad(ctx->xusb_ctx, false);
 	}
+}
+
+/* 1/8 weight, same as xusb uses for the polling period. */
+static void xbox360wr_average(u64 *average, u64 sample)
+{
+	if (*average)
+		*average += ((s64)sample - (s64)*average) / 8;
+	else
+		*average = sample;
+}
 
-	/* Can't really do anything here... */
+/* Must be called with ctx->lock held. */
+static void xbox360wr_start_link_timer(struct xbox360wr_context *ctx)
+{
+	unsigned int timeout_ms = READ_ONCE(link_timeout_ms);
+
+	lockdep_assert_held(&ctx->lock);
+
+	if (!timeout_ms || ctx->link.timer_running)
+		return;
+
+	ctx->link.timer_running = true;
+	hrtimer_start(&ctx->link.timer,
+	  ms_to_ktime(timeout_ms) / 4, HRTIMER_MODE_REL_SOFT);
+}
+
+/* Checks in four times per timeout. Halfway there it asks the
+   adapter about the pad, which is sometimes enough to get the
+   disconnect out of it early; past the timeout the pad is
+   detached and handed to xbox360wr_link_timeout(). */
+static enum hrtimer_restart xbox360wr_link_timer(struct hrtimer *timer)
+{
+	struct xbox360wr_context *ctx =
+	  container_of(timer, struct xbox360wr_context, link.timer);
+
+	enum hrtimer_restart restart = HRTIMER_NORESTART;
+	unsigned int timeout_ms = READ_ONCE(link_timeout_ms);
+	unsigned long flags;
+	s64 idle_ms;
+
+	spin_lock_irqsave(&ctx->lock, flags);
+
+	if (!ctx->xusb_ctx || !timeout_ms)
+		goto out;
+
+	idle_ms = ktime_ms_delta(ktime_get(), ctx->link.last_alive);
+
+	/* The last one we gave up on hasn't been let go yet. */
+	if (idle_ms >= timeout_ms && !ctx->link.timed_out) {
+		printk(KERN_INFO "Controller link timed out after %lld ms\n",
+		  idle_ms);
+
+		ctx->link.timeouts++;
+		ctx->link.lost = true;
+
+		ctx->link.timed_out = ctx->xusb_ctx;
+		ctx->xusb_ctx = 0;
+		ctx->attachment = false;
+		ctx->chatpad_attached = false;
+		schedule_work(&ctx->link.timeout_work);
+		goto out;
+	}
+
+	if (idle_ms >= timeout_ms / 2 && !ctx->link.query_sent)
+		xbox360wr_query_presence(ctx);
+
+	hrtimer_forward_now(timer, ms_to_ktime(timeout_ms) / 4);
+	restart = HRTIMER_RESTART;
+
+out:
+	ctx->link.timer_running = (restart == HRTIMER_RESTART);
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	return restart;
+}
+
+static void xbox360wr_link_timeout(struct work_struct *work)
+{
+	struct xbox360wr_context *ctx =
+	  container_of(work, struct xbox360wr_context, link.timeout_work);
+
+	struct xusb_context *xusb_ctx;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	xusb_ctx = ctx->link.timed_out;
+	ctx->link.timed_out = 0;
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	if (xusb_ctx)
+		xusb_unregister_device(xusb_ctx);
 }
 
 static struct xusb_driver xbox360wr_driver = {
@@ -167,23 +352,70 @@ static void xpad360_parse_input(void *data, XINPUT_GAMEPAD *out)
 	out->sThumbRY = (__s16)le16_to_cpup((__le16*)&buffer[10]);
 }
 
-/* Interrupt for incoming URB.  */
-static void xbox360wr_receive(struct urb* urb)
+/* Must be called with ctx->lock held. */
+static void xbox360wr_update_link(struct xbox360wr_context *ctx,
+  u8 *data, ktime_t timestamp)
 {
-	struct xbox360wr_context *ctx = urb->context;
-	u8 *data = urb->transfer_buffer;
+	struct xbox360wr_link *link = &ctx->link;
+
+	lockdep_assert_held(&ctx->lock);
+
+	/* Anything from the adapter answers the presence query. */
+	if (data[0] == 0x08) {
+		if (link->query_sent) {
+			xbox360wr_average(&link->rtt_ns, ktime_to_ns(
+			  ktime_sub(timestamp, link->query_sent)));
+			link->query_sent = 0;
+		}
+
+		/* Still connected as far as the adapter knows. */
+		if ((data[1] & 0x80) && ctx->xusb_ctx)
+			link->last_alive = timestamp;
 
-	switch (urb->status) {
-	case 0:
-		break;
-	case -ECONNRESET:
-	case -ENOENT:
-	case -ESHUTDOWN:
 		return;
-	default:
-		goto finish;
 	}
 
+	if (data[0] != 0x00)
+		return;
+
+	if (!ctx->xusb_ctx) {
+		/* It's back after we gave up on it. Have the adapter
+		   announce it again. */
+		if (link->lost) {
+			link->lost = false;
+			xbox360wr_query_presence(ctx);
+		}
+
+		return;
+	}
+
+	if (link->last_rx) {
+		u64 gap = ktime_to_ns(ktime_sub(timestamp, link->last_rx));
+
+		xbox360wr_average(&link->gap_ns, gap);
+		link->gap_max_ns = max(link->gap_max_ns, gap);
+	}
+
+	link->last_rx = timestamp;
+	link->last_alive = timestamp;
+
+	switch (le16_to_cpup((__le16*)&data[1])) {
+	case 0x01F8:
+		if (link->pings && !link->ping_answered)
+			link->missed_pings++;
+
+		link->pings++;
+		link->ping_answered = false;
+		break;
+	case 0x02F8:
+		link->ping_answered = true;
+		break;
+	}
+}
+
+static void xbox360wr_handle_packet(struct xbox360wr_context *ctx,
+  u8 *data, u32 length, ktime_t timestamp)
+{
 	/* Event from Adapter */
 	if (data[0] == 0x08) {
 		switch (data[1]) {
@@ -195,30 +427,47 @@ static void xbox360wr_receive(struct urb* urb)
 			if (!ctx->xusb_ctx)
 				break;
 
+			/* Takes the chatpad's keyboard with it. */
 			xusb_unregister_device(ctx->xusb_ctx);
 			ctx->xusb_ctx = 0;
+			ctx->attachment = false;
+			ctx->chatpad_attached = false;
 			break;
 
 		case 0xC0:
-			/* Connect w/ Headset (attachment?) */
-			/* We don't handle attachments. TODO */
+			/* Connect w/ attachment. Could be a headset or a
+			   chatpad, it's only known once it sends something. */
 		case 0x80: {
 			/* Connect */
 
 			/* Might happen if a presence packet is sent
 			   while we're already connected */
-			if (ctx->xusb_ctx != 0)
+			if (ctx->xusb_ctx != 0) {
+				xbox360wr_update_attachment(ctx, data[1] & 0x40);
 			 	break;
+			}
 
 			ctx->xusb_ctx = xusb_register_device( /* HARDCODED FIXME */
-				&xbox360wr_driver, &xbox360wr_devices[0], ctx);
+				&ctx->ep, &xbox360wr_driver, &xbox360wr_devices[0], ctx);
+
+			/* Stats are per connection. */
+			ctx->link.last_rx = timestamp;
+			ctx->link.last_alive = timestamp;
+			ctx->link.gap_ns = 0;
+			ctx->link.gap_max_ns = 0;
+			ctx->link.ping_answered = true;
+			ctx->link.lost = false;
+
+			if (ctx->xusb_ctx) {
+				xbox360wr_start_link_timer(ctx);
+				xbox360wr_update_attachment(ctx, data[1] & 0x40);
+			}
 
 			break;
 		}
 
 		case 0x40:
-			/* Headset Connected (attachment?) */
-			/* We don't handle attachments. TODO */
+			/* Attachment without a pad? Not handled. */
 			break;
 		}
 	}
@@ -231,11 +480,49 @@ static void xbox360wr_receive(struct urb* urb)
 			break;
 
 		case 0x0001: { /* Input Event */
-			XINPUT_GAMEPAD input;
-			xpad360_parse_input(&data[6], &input);
-			xusb_report_input(ctx->xusb_ctx, &input);
+			struct xusb_report *report;
+
+			/* Connection may have failed for lack of contexts. */
+			if (!ctx->xusb_ctx)
+				break;
+
+			report = xusb_begin_report(ctx->xusb_ctx);
+			if (!report)
+				break;
+
+			xpad360_parse_input(&data[6], &report->Gamepad);
+			xusb_commit_report(ctx->xusb_ctx, timestamp);
 			break;
 		}
+		case 0x0002: /* Chatpad Event */
+			if (!ctx->xusb_ctx)
+				break;
+
+			/* First word from it, so it is a chatpad. */
+			if (!ctx->chatpad_attached) {
+				ctx->chatpad_attached = true;
+				xusb_attach_chatpad(ctx->xusb_ctx, true);
+				hrtimer_start(&ctx->chatpad_timer,
+				  ms_to_ktime(1000), HRTIMER_MODE_REL_SOFT);
+			}
+
+			/* Short ones would decode whatever the last packet
+			   left in the buffer. */
+			if (length < 28)
+				break;
+
+			/* 0xF0 is some sort of status we don't understand.
+			   Keys are 0x00: modifiers, then up to two keys. */
+			if (data[24] == 0x00) {
+				struct xusb_chatpad_report report = {
+					.modifiers = data[25],
+					.keys = { data[26], data[27] }
+				};
+
+				xusb_report_chatpad(ctx->xusb_ctx, &report, timestamp);
+			}
+
+			break;
 		case 0x000A:
 			/* Occurs after Headset Connection packet (0x40)
 			   An arbitrarily sized description string
@@ -254,14 +541,71 @@ static void xbox360wr_receive(struct urb* urb)
 			   Occurs right after Controller Connection Packet (0x80)*/
 			break;
 		default:
-			printk(KERN_ERR "Unknown packet receieved. Header was %#.8x\n", header);
+			/* Unknown. Use XUSB_IOC_TAP to see these, printing
+			   them here was far too slow for a completion handler. */
+			xusb_endpoint_unknown(&ctx->ep, header);
 		}
 	}
+}
 
-finish:
-	usb_submit_urb(urb, GFP_ATOMIC);
+/* Called from the IN endpoint's completion handler. */
+static void xbox360wr_receive(void *context, u8 *data, u32 length,
+  ktime_t timestamp)
+{
+	struct xbox360wr_context *ctx = context;
+	unsigned long flags;
+
+	/* Only ever contended by the link timer. */
+	spin_lock_irqsave(&ctx->lock, flags);
+	xbox360wr_update_link(ctx, data, timestamp);
+	xbox360wr_handle_packet(ctx, data, length, timestamp);
+	spin_unlock_irqrestore(&ctx->lock, flags);
 }
 
+#define to_xbox360wr_context(dev) \
+	container_of((struct xusb_endpoint *)dev_get_drvdata(dev), \
+	  struct xbox360wr_context, ep)
+
+#define XBOX360WR_LINK_ATTR(name, format, value) \
+static ssize_t name##_show(struct device *dev, \
+  struct device_attribute *attr, char *buf) \
+{ \
+	struct xbox360wr_link *link = &to_xbox360wr_context(dev)->link; \
+	return sysfs_emit(buf, format "\n", value); \
+} \
+static DEVICE_ATTR_RO(name)
+
+XBOX360WR_LINK_ATTR(rtt_us, "%llu",
+  div_u64(READ_ONCE(link->rtt_ns), NSEC_PER_USEC));
+XBOX360WR_LINK_ATTR(gap_us, "%llu",
+  div_u64(READ_ONCE(link->gap_ns), NSEC_PER_USEC));
+XBOX360WR_LINK_ATTR(gap_max_us, "%llu",
+  div_u64(READ_ONCE(link->gap_max_ns), NSEC_PER_USEC));
+XBOX360WR_LINK_ATTR(pings, "%lu", READ_ONCE(link->pings));
+XBOX360WR_LINK_ATTR(missed_pings, "%lu", READ_ONCE(link->missed_pings));
+XBOX360WR_LINK_ATTR(timeouts, "%lu", READ_ONCE(link->timeouts));
+
+static struct attribute *xbox360wr_link_attrs[] = {
+	&dev_attr_rtt_us.attr,
+	&dev_attr_gap_us.attr,
+	&dev_attr_gap_max_us.attr,
+	&dev_attr_pings.attr,
+	&dev_attr_missed_pings.attr,
+	&dev_attr_timeouts.attr,
+	NULL
+};
+
+static const struct attribute_group xbox360wr_link_group = {
+	.name = "link",
+	.attrs = xbox360wr_link_attrs
+};
+
+static const struct attribute_group *xbox360wr_groups[] = {
+	&xusb_endpoint_group,
+	&xbox360wr_link_group,
+	NULL
+};
+
 /* The wireless adapter will throw four interfaces at us,
    each one representing a controller. Initialization is
    very similar to the wired version. So much so, I'd imagine
@@ -270,52 +614,33 @@ finish:
 static int xbox360wr_probe(struct usb_interface *intf,
 	const struct usb_device_id *id)
 {
-	struct usb_device *usb_dev = interface_to_usbdev(intf);
-	struct usb_endpoint_descriptor *ep =
-		&intf->cur_altsetting->endpoint[0].desc;
-
-	const int pipe = usb_rcvintpipe(usb_dev, ep->bEndpointAddress);
 	struct xbox360wr_context *ctx;
+	unsigned long flags;
 
 	int error = 0;
-	void *in_buffer;
-	dma_addr_t in_dma;
 
-	ctx = kmalloc(sizeof(struct xbox360wr_context), GFP_KERNEL);
+	ctx = kzalloc(sizeof(struct xbox360wr_context), GFP_KERNEL);
 
 	if (!ctx) {
 		return -ENOMEM;
 	}
 
-	usb_set_intfdata(intf, ctx);
 	ctx->usb_intf = intf;
 	ctx->xusb_ctx = 0;
-	ctx->pipe_out =
-	  usb_sndintpipe(usb_dev,
-	    intf->cur_altsetting->endpoint[1].desc.bEndpointAddress);
+	spin_lock_init(&ctx->lock);
+	hrtimer_setup(&ctx->link.timer, xbox360wr_link_timer,
+	  CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	INIT_WORK(&ctx->link.timeout_work, xbox360wr_link_timeout);
+	hrtimer_setup(&ctx->chatpad_timer, xbox360wr_chatpad_timer,
+	  CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
 
-	ctx->in = usb_alloc_urb(0, GFP_KERNEL);
-	if (!ctx->in) {
-		error = -ENOMEM;
-		goto fail_urb_alloc;
-	}
+	error = xusb_endpoint_init(&ctx->ep, intf,
+	  XBOX360WR_PACKET_SIZE, xbox360wr_receive, ctx);
 
-	in_buffer =
-	usb_alloc_coherent(
-		usb_dev, XBOX360WR_PACKET_SIZE,
-		GFP_KERNEL, &in_dma);
+	if (error)
+		goto fail_endpoint;
 
-	if (!in_buffer) {
-		error = -ENOMEM;
-		goto fail_alloc_coherent;
-	}
-
-	usb_fill_int_urb(
-		ctx->in, usb_dev,
-		pipe, in_buffer, XBOX360WR_PACKET_SIZE,
-		xbox360wr_receive, ctx, ep->bInterval);
-
-	error = usb_submit_urb(ctx->in, GFP_KERNEL);
+	error = xusb_endpoint_start(&ctx->ep);
 	if (error) {
 		error = -ENOMEM;
 		goto fail_in_submit;
@@ -325,15 +650,15 @@ static int xbox360wr_probe(struct usb_interface *intf,
 	   This is useful in the case we activate the module after the
 	   adapter has been plugged in, as it won't automatically
 	   send us info about the controllers. */
+	spin_lock_irqsave(&ctx->lock, flags);
 	xbox360wr_query_presence(ctx);
+	spin_unlock_irqrestore(&ctx->lock, flags);
 
 	return 0;
 
 fail_in_submit:
-	usb_free_coherent(usb_dev, XBOX360WR_PACKET_SIZE, in_buffer, in_dma);
-fail_alloc_coherent:
-	usb_free_urb(ctx->in);
-fail_urb_alloc:
+	xusb_endpoint_destroy(&ctx->ep);
+fail_endpoint:
 	kfree(ctx);
 
 	return error;
@@ -341,19 +666,24 @@ fail_urb_alloc:
 
 static void xbox360wr_disconnect(struct usb_interface *intf)
 {
-	struct xbox360wr_context *ctx = usb_get_intfdata(intf);
-	struct usb_device *usb_dev = interface_to_usbdev(intf);
-	struct urb *in_urb = ctx->in;
+	struct xbox360wr_context *ctx =
+	  container_of(usb_get_intfdata(intf), struct xbox360wr_context, ep);
 
-	usb_kill_urb(in_urb);
-	usb_free_coherent(usb_dev, XBOX360WR_PACKET_SIZE,
-	in_urb->transfer_buffer, in_urb->transfer_dma);
-	usb_free_urb(in_urb);
+	xusb_endpoint_destroy(&ctx->ep);
 
-	if (ctx->xusb_ctx != 0) {
+	/* Might time the pad out on its own otherwise. Flushed rather
+	   than cancelled so a pad it already detached is let go. */
+	hrtimer_cancel(&ctx->link.timer);
+	flush_work(&ctx->link.timeout_work);
+	hrtimer_cancel(&ctx->chatpad_timer);
+
+	if (ctx->xusb_ctx != 0)
 		xusb_unregister_device(ctx->xusb_ctx);
-		xusb_flush();
-	}
+
+	/* Unregistering may have been queued from the completion
+	   handler or the timeout, not just above. Either way it
+	   still calls into us until it's done. */
+	xusb_flush();
 
 	kfree(ctx);
 }
@@ -368,6 +698,7 @@ static struct usb_driver xbox360wr_usb_driver = {
 	.id_table = xbox360wr_table,
 	.probe = xbox360wr_probe,
 	.disconnect = xbox360wr_disconnect,
+	.dev_groups = xbox360wr_groups,
 	.soft_unbind = 1
 };
 
@@ -6,6 +6,26 @@
 #include <linux/slab.h>
 #include <linux/module.h>
 #include <linux/input.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/bitops.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/leds.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/hrtimer.h>
+#include <linux/uaccess.h>
+#include <linux/anon_inodes.h>
+#include <linux/file.h>
+#include <linux/vmalloc.h>
+#include <linux/jump_label.h>
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 /* XUSB_MAX_CONTROLLERS can be set to any arbitrary number.
    We make it 4 to match XInput. */
@@ -17,7 +37,9 @@
         what parts are fragile and what parts aren't at this point.
    TODO before requesting for patches:
      - Clean up commit history.
-     - Fix data race between work queue and spinlocks. */
+     - Fix data race between work queue and spinlocks. Run
+        tools/run-qemu.sh with both kasan and kcsan until it comes
+        back clean before taking this off. */
 
 #define XINPUT_LIMIT 4
 #define XINPUT_INVALID -1
@@ -50,32 +72,518 @@ static const int xinput_to_codes[12] = {
 	BTN_X,          BTN_Y,
 };
 
-/* We don't hold a static number of input work.
-   Thus, it doesn't make sense to hold it within
-   the xusb_context structure. */
-struct xusb_input_work {
-	XINPUT_GAMEPAD input;
-	struct input_dev *input_dev;
-	struct work_struct work;
+/* Absolute axes for the analog face buttons, indexed by XUSB_ANALOG_*.
+   The input layer has nothing specific for these. */
+static const int xinput_analog_to_codes[XUSB_ANALOG_BUTTONS] = {
+	ABS_MISC,       ABS_MISC + 1,
+	ABS_MISC + 2,   ABS_MISC + 3,
+	ABS_MISC + 4,   ABS_MISC + 5
+};
+
+/* Virtual key for each bit in wButtons, 0 if there isn't one. */
+static const u16 xinput_button_to_vk[16] = {
+	VK_PAD_DPAD_UP,         VK_PAD_DPAD_DOWN,
+	VK_PAD_DPAD_LEFT,       VK_PAD_DPAD_RIGHT,
+	VK_PAD_START,           VK_PAD_BACK,
+	VK_PAD_LTHUMB_PRESS,    VK_PAD_RTHUMB_PRESS,
+	VK_PAD_LSHOULDER,       VK_PAD_RSHOULDER,
+	0,                      0,
+	VK_PAD_A,               VK_PAD_B,
+	VK_PAD_X,               VK_PAD_Y
+};
+
+#define XUSB_KEYSTROKE_QUEUE 16
+
+/* Chatpad scan codes, from xboxdrv's chatpad support. */
+static const u16 xusb_chatpad_keys[256] = {
+	[0x17] = KEY_1,         [0x16] = KEY_2,         [0x15] = KEY_3,
+	[0x14] = KEY_4,         [0x13] = KEY_5,         [0x12] = KEY_6,
+	[0x11] = KEY_7,         [0x67] = KEY_8,         [0x66] = KEY_9,
+	[0x65] = KEY_0,
+
+	[0x27] = KEY_Q,         [0x26] = KEY_W,         [0x25] = KEY_E,
+	[0x24] = KEY_R,         [0x23] = KEY_T,         [0x22] = KEY_Y,
+	[0x21] = KEY_U,         [0x76] = KEY_I,         [0x75] = KEY_O,
+	[0x64] = KEY_P,
+
+	[0x37] = KEY_A,         [0x36] = KEY_S,         [0x35] = KEY_D,
+	[0x34] = KEY_F,         [0x33] = KEY_G,         [0x32] = KEY_H,
+	[0x31] = KEY_J,         [0x77] = KEY_K,         [0x72] = KEY_L,
+	[0x62] = KEY_COMMA,
+
+	[0x46] = KEY_Z,         [0x45] = KEY_X,         [0x44] = KEY_C,
+	[0x43] = KEY_V,         [0x42] = KEY_B,         [0x41] = KEY_N,
+	[0x52] = KEY_M,         [0x53] = KEY_DOT,       [0x63] = KEY_ENTER,
+
+	[0x55] = KEY_LEFT,      [0x54] = KEY_SPACE,     [0x51] = KEY_RIGHT,
+	[0x71] = KEY_BACKSPACE
+};
+
+/* The colored keys are left for the keymap to make sense of. */
+static const u16 xusb_chatpad_modifiers[4] = {
+	KEY_LEFTSHIFT,          /* XUSB_CHATPAD_SHIFT */
+	KEY_LEFTCTRL,           /* XUSB_CHATPAD_GREEN */
+	KEY_RIGHTALT,           /* XUSB_CHATPAD_ORANGE */
+	KEY_LEFTMETA            /* XUSB_CHATPAD_MESSENGER */
+};
+
+/* Like XUSB_INPUT_QUEUE, but typing is a lot slower than sticks. */
+#define XUSB_CHATPAD_QUEUE 8
+
+struct xusb_chatpad_slot {
+	struct xusb_chatpad_report report;
+	ktime_t timestamp;
+};
+
+/* Contexts come out of a fixed pool so connecting a controller
+   from interrupt context never has to allocate. It also bounds
+   how many devices we'll drive at once, XInput index or not. */
+#define XUSB_MAX_CONTEXTS 16
+
+/* Reports waiting to be emitted. Only needs to absorb the latency
+   of the workqueue; anything beyond this is counted and dropped. */
+#define XUSB_INPUT_QUEUE 16
+
+struct xusb_input_slot {
+	struct xusb_report report;
+	ktime_t timestamp;
 };
 
+/* A context holds one reference for the transport, released by
+   xusb_unregister_device(), and one for each queued work item.
+   Once the last one is gone the slot is returned to the pool after
+   an RCU grace period so lockless readers of xusb_index[] never see
+   it reused underneath them. */
 struct xusb_context {
-	u8 index;
+	int index; /* XINPUT_INVALID if there was no room */
+
+	struct kref ref;
+	struct rcu_head rcu;
 
 	void *user_data;
 	struct xusb_driver *driver;
+	struct xusb_endpoint *ep;
+
+	/* Published by the register work once it's registered, which
+	   can be well after input starts arriving. */
 	struct input_dev *input_dev;
 
+	/* Only touched by input_work. The latest report is kept so it
+	   can be replayed to evdev once input_dev shows up. */
+	struct xusb_report last_report;
+	ktime_t last_timestamp;
+	bool have_report;
+	bool replayed;
+
+	/* For measuring how long it takes from probe to first event. */
+	ktime_t probe_time;
+
+	/* Exposes the ring of LEDs as a single led_classdev whose
+	   brightness is an XINPUT_LED_STATUS. */
+	struct led_classdev led;
+	char led_name[16];
+	bool led_registered;
+
 	struct work_struct register_work;
 	struct work_struct unregister_work;
+	struct work_struct input_work;
 
 	struct xusb_device *device;
+
+	/* Single producer (the transport's completion handler), single
+	   consumer (input_work). Indices are free running. */
+	struct xusb_input_slot input_queue[XUSB_INPUT_QUEUE];
+	unsigned int input_head;
+	unsigned int input_tail;
+	unsigned long input_dropped;
+
+	/* Producer only. Reports identical to the last one committed
+	   aren't queued at all. */
+	struct xusb_report last_committed;
+	bool have_committed;
+
+	/* Chatpad, as a keyboard of its own. chatpad_dev is published
+	   by chatpad_work the same way input_dev is. The queue works
+	   just like input_queue, and chatpad_last is input_work's. */
+	struct input_dev *chatpad_dev;
+	bool chatpad_attached;
+	struct work_struct chatpad_work;
+	struct xusb_chatpad_slot chatpad_queue[XUSB_CHATPAD_QUEUE];
+	unsigned int chatpad_head;
+	unsigned int chatpad_tail;
+	unsigned long chatpad_dropped;
+	struct xusb_chatpad_report chatpad_last;
+
+	/* Last emitted state and the keystrokes derived from it.
+	   Written from the workqueue, read by anyone. state is read
+	   locklessly through state_seq; keystrokes need the lock since
+	   reading one consumes it. */
+	spinlock_t state_lock;
+	seqcount_spinlock_t state_seq;
+	struct xusb_state state;
+	struct xusb_keystroke keystrokes[XUSB_KEYSTROKE_QUEUE];
+	unsigned int keystroke_head;
+	unsigned int keystroke_count;
 };
 
+/* Input is handled on xusb_wq. Registering and unregistering happen
+   on xusb_register_wq so that a slow input_register_device() (and
+   everything udev does in response) doesn't hold up input for the
+   pads that are already connected.
+
+   xusb_wq is per-CPU so input work runs on the CPU that completed
+   the URB (or the one picked in sysfs) instead of bouncing the
+   context's cache lines to wherever an unbound worker is. Each
+   context only has the one input_work and a work item never runs
+   concurrently with itself, so a pad's reports stay in order. The
+   register queue is ordered. */
 static struct workqueue_struct *xusb_wq;
+static struct workqueue_struct *xusb_register_wq;
+
+static unsigned int poll_interval;
+module_param(poll_interval, uint, 0644);
+MODULE_PARM_DESC(poll_interval,
+  "Interrupt IN polling interval in microseconds for newly bound "
+  "devices. 0 uses the endpoint descriptor (default).");
+
+static unsigned int idle_timeout_ms;
+module_param(idle_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(idle_timeout_ms,
+  "Poll at idle_interval_ms instead once a device has sent nothing "
+  "but identical packets for this long. 0 disables (default).");
+
+static unsigned int idle_interval_ms = 50;
+module_param(idle_interval_ms, uint, 0644);
+MODULE_PARM_DESC(idle_interval_ms,
+  "Polling interval in milliseconds for idle devices.");
+
+static bool compact_indices;
+module_param(compact_indices, bool, 0644);
+MODULE_PARM_DESC(compact_indices,
+  "Shift controllers down to fill the gap when one disconnects. "
+  "Player LEDs follow. Off by default, like XInput.");
+
+static struct xusb_context xusb_pool[XUSB_MAX_CONTEXTS];
+static DECLARE_BITMAP(xusb_pool_used, XUSB_MAX_CONTEXTS);
+
+/* Readers use RCU and never block or disable interrupts. Writers
+   only ever run from the workqueue and serialize on the mutex. */
+static struct xusb_context __rcu *xusb_index[XINPUT_LIMIT];
+static DEFINE_MUTEX(xusb_index_mutex);
+
+static void xusb_led_set(struct led_classdev *led_cdev,
+  enum led_brightness value)
+{
+	struct xusb_context *ctx =
+	  container_of(led_cdev, struct xusb_context, led);
+
+	/* Nonblocking, this only queues the packet. */
+	ctx->driver->set_led(ctx->user_data, value);
+}
+
+/* Shows the player number on the ring, if we have one. */
+static void xusb_update_player_led(struct xusb_context *ctx)
+{
+	enum XINPUT_LED_STATUS status;
+
+	if (ctx->index == XINPUT_INVALID || !ctx->led_registered)
+		return;
+
+	status = XINPUT_LED_ON_1 + ctx->index;
+	ctx->led.brightness = status;
+	ctx->driver->set_led(ctx->user_data, status);
+}
+
+static void xusb_register_led(struct xusb_context *ctx)
+{
+	if (!ctx->driver->set_led)
+		return;
+
+	memset(&ctx->led, 0, sizeof(ctx->led));
+
+	snprintf(ctx->led_name, sizeof(ctx->led_name),
+	  "xusb%d", (int)(ctx - xusb_pool));
+
+	ctx->led.name = ctx->led_name;
+	ctx->led.max_brightness = XINPUT_LED_ALTERNATING;
+	ctx->led.brightness_set = xusb_led_set;
+
+	/* Turning it off as the device goes away would only queue
+	   a packet to a device that isn't there anymore. */
+	ctx->led.flags = LED_RETAIN_AT_SHUTDOWN;
+
+	if (led_classdev_register(&ctx->ep->intf->dev, &ctx->led) != 0) {
+		printk(KERN_ERR "Failed to register LED device!\n");
+		return;
+	}
+
+	ctx->led_registered = true;
+}
+
+/* Caller must be in an RCU read-side critical section. */
+static struct xusb_context *xusb_lookup(u8 index)
+{
+	if (index >= XINPUT_LIMIT)
+		return NULL;
+
+	return rcu_dereference(xusb_index[index]);
+}
+
+static void xusb_assign_index(struct xusb_context *ctx)
+{
+	mutex_lock(&xusb_index_mutex);
+
+	for (int i = 0; i < XINPUT_LIMIT; ++i) {
+		if (!rcu_access_pointer(xusb_index[i])) {
+			WRITE_ONCE(ctx->index, i);
+			rcu_assign_pointer(xusb_index[i], ctx);
+			break;
+		}
+	}
+
+	mutex_unlock(&xusb_index_mutex);
+
+	printk("Assigning controller index %d", ctx->index);
+
+	if (ctx->index == XINPUT_INVALID)
+		printk("More than 4 XInput controllers connected.");
+}
+
+/* Merged pads ("copilot")
+
+   Several pads can be combined into one player. The first pad of a
+   group, the primary, emits for all of them: buttons are OR'd,
+   triggers and analog buttons take the highest value, and each
+   stick comes from the first pad in the group (primary first) that
+   has it outside the deadzone. The other members go quiet on both
+   evdev and XInput. Rumble sent to the primary goes to every
+   member. Groups are set up by XInput index through the copilot
+   attribute of the misc device, but they belong to the pads: they
+   follow them when indices are compacted, and a pad that goes away
+   leaves its group. */
+
+/* Index of the primary each index feeds into, -1 if not merged.
+   A primary points at itself. */
+static int xusb_merge_targets[XINPUT_LIMIT] = {
+	[0 ... XINPUT_LIMIT - 1] = -1
+};
+
+/* Guards the targets and the fields below. Only held long enough to
+   copy a report in and the combined one out. */
+static DEFINE_SPINLOCK(xusb_merge_lock);
+static struct xusb_report xusb_merge_latest[XINPUT_LIMIT];
+static unsigned long xusb_merge_have;
+
+/* Serializes emission for merged pads, whichever CPU their input
+   work runs on, and keeps compaction from moving indices under it. */
+static DEFINE_MUTEX(xusb_merge_emit_mutex);
+
+static int xusb_merge_target(int index)
+{
+	if (index == XINPUT_INVALID)
+		return -1;
+
+	return READ_ONCE(xusb_merge_targets[index]);
+}
+
+static void xusb_vibrate_members(int primary, XINPUT_VIBRATION vibration)
+{
+	rcu_read_lock();
+
+	for (int i = 0; i < XINPUT_LIMIT; ++i) {
+		struct xusb_context *ctx;
+		struct xusb_driver *driver;
+
+		if (i == primary || xusb_merge_target(i) != primary)
+			continue;
+
+		ctx = xusb_lookup(i);
+		driver = ctx ? READ_ONCE(ctx->driver) : NULL;
+
+		if (driver)
+			driver->set_vibration(ctx->user_data, vibration);
+	}
+
+	rcu_read_unlock();
+}
+
+/* Drops a pad that's going away from its group. Losing the primary,
+   or everyone but the primary, breaks the group up. Called with
+   xusb_index_mutex held, before the index is released. */
+static void xusb_merge_forget(struct xusb_context *ctx)
+{
+	int index = ctx->index;
+	unsigned long flags;
+	int target, left = 0;
+
+	lockdep_assert_held(&xusb_index_mutex);
+
+	if (index == XINPUT_INVALID)
+		return;
+
+	spin_lock_irqsave(&xusb_merge_lock, flags);
+	clear_bit(index, &xusb_merge_have);
+
+	target = xusb_merge_targets[index];
+	if (target < 0)
+		goto out;
+
+	WRITE_ONCE(xusb_merge_targets[index], -1);
+
+	for (int i = 0; i < XINPUT_LIMIT; ++i) {
+		if (xusb_merge_targets[i] == target)
+			++left;
+	}
+
+	if (target != index && left > 1)
+		goto out;
+
+	for (int i = 0; i < XINPUT_LIMIT; ++i) {
+		if (xusb_merge_targets[i] == target) {
+			WRITE_ONCE(xusb_merge_targets[i], -1);
+			clear_bit(i, &xusb_merge_have);
+		}
+	}
+
+out:
+	spin_unlock_irqrestore(&xusb_merge_lock, flags);
+}
+
+/* Compaction moved a pad from one index to an empty one. Its group
+   goes with it. Called with xusb_merge_emit_mutex held. */
+static void xusb_merge_move(int from, int to)
+{
+	unsigned long flags;
+
+	lockdep_assert_held(&xusb_merge_emit_mutex);
+
+	spin_lock_irqsave(&xusb_merge_lock, flags);
+
+	for (int i = 0; i < XINPUT_LIMIT; ++i) {
+		if (xusb_merge_targets[i] == from)
+			WRITE_ONCE(xusb_merge_targets[i], to);
+	}
+
+	WRITE_ONCE(xusb_merge_targets[to], xusb_merge_targets[from]);
+	WRITE_ONCE(xusb_merge_targets[from], -1);
+
+	xusb_merge_latest[to] = xusb_merge_latest[from];
+	if (test_and_clear_bit(from, &xusb_merge_have))
+		set_bit(to, &xusb_merge_have);
+
+	spin_unlock_irqrestore(&xusb_merge_lock, flags);
+}
+
+/* Moves everyone down to fill gaps and redoes their player LEDs.
+   Caller must hold xusb_index_mutex. */
+static void xusb_compact_indices(void)
+{
+	int next = 0;
+
+	lockdep_assert_held(&xusb_index_mutex);
+
+	mutex_lock(&xusb_merge_emit_mutex);
+
+	for (int i = 0; i < XINPUT_LIMIT; ++i) {
+		struct xusb_context *ctx =
+		  rcu_dereference_protected(xusb_index[i],
+		    lockdep_is_held(&xusb_index_mutex));
+
+		if (!ctx)
+			continue;
+
+		if (i != next) {
+			WRITE_ONCE(ctx->index, next);
+			rcu_assign_pointer(xusb_index[next], ctx);
+			RCU_INIT_POINTER(xusb_index[i], NULL);
+			xusb_merge_move(i, next);
+
+			printk("Moving controller index %d to %d", i, next);
+			xusb_update_player_led(ctx);
+		}
+
+		++next;
+	}
+
+	mutex_unlock(&xusb_merge_emit_mutex);
+}
 
-static struct xusb_context *xusb_index[4] = { 0 };
-static DEFINE_SPINLOCK(xusb_index_lock);
+static void xusb_release_index(struct xusb_context *ctx)
+{
+	if (ctx->index == XINPUT_INVALID)
+		return;
+
+	mutex_lock(&xusb_index_mutex);
+	xusb_merge_forget(ctx);
+	RCU_INIT_POINTER(xusb_index[ctx->index], NULL);
+
+	if (compact_indices)
+		xusb_compact_indices();
+
+	mutex_unlock(&xusb_index_mutex);
+}
+
+static struct xusb_context *xusb_context_alloc(void)
+{
+	int i;
+
+	do {
+		i = find_first_zero_bit(xusb_pool_used, XUSB_MAX_CONTEXTS);
+		if (i >= XUSB_MAX_CONTEXTS)
+			return NULL;
+	} while (test_and_set_bit_lock(i, xusb_pool_used));
+
+	return &xusb_pool[i];
+}
+
+static void xusb_context_free_rcu(struct rcu_head *head)
+{
+	struct xusb_context *ctx =
+	  container_of(head, struct xusb_context, rcu);
+
+	clear_bit_unlock(ctx - xusb_pool, xusb_pool_used);
+}
+
+static void xusb_context_release(struct kref *ref)
+{
+	struct xusb_context *ctx =
+	  container_of(ref, struct xusb_context, ref);
+
+	call_rcu(&ctx->rcu, xusb_context_free_rcu);
+}
+
+static void xusb_context_put(struct xusb_context *ctx)
+{
+	kref_put(&ctx->ref, xusb_context_release);
+}
+
+/* Takes a reference on behalf of the work item. */
+static void xusb_queue_work(struct xusb_context *ctx,
+  struct workqueue_struct *wq, struct work_struct *work)
+{
+	kref_get(&ctx->ref);
+
+	if (!queue_work(wq, work))
+		xusb_context_put(ctx);
+}
+
+/* Called from the transport's completion handler. */
+static void xusb_queue_input(struct xusb_context *ctx)
+{
+	int cpu = READ_ONCE(ctx->ep->work_cpu);
+
+	kref_get(&ctx->ref);
+
+	/* Even if the CPU's gone offline since it was set, the work
+	   still runs, just not bound to it. */
+	if (cpu < 0) {
+		if (!queue_work(xusb_wq, &ctx->input_work))
+			xusb_context_put(ctx);
+	} else {
+		if (!queue_work_on(cpu, xusb_wq, &ctx->input_work))
+			xusb_context_put(ctx);
+	}
+}
 
 static void xusb_setup_analog(struct input_dev *input_dev, int code, s16 res)
 {
@@ -99,6 +607,26 @@ static void xusb_setup_hatswitch(struct input_dev *input_dev, int code)
 	input_set_abs_params(input_dev, code, -1, 1, 0, 0);
 }
 
+/* Runs from a timer, this only queues the packet. */
+static int xusb_play_effect(struct input_dev *dev, void *data,
+  struct ff_effect *effect)
+{
+	struct xusb_context *ctx = data;
+	struct xusb_driver *driver = READ_ONCE(ctx->driver);
+	XINPUT_VIBRATION vibration;
+
+	if (effect->type != FF_RUMBLE || !driver)
+		return 0;
+
+	vibration.wLeftMotorSpeed = effect->u.rumble.strong_magnitude;
+	vibration.wRightMotorSpeed = effect->u.rumble.weak_magnitude;
+
+	driver->set_vibration(ctx->user_data, vibration);
+	xusb_vibrate_members(READ_ONCE(ctx->index), vibration);
+
+	return 0;
+}
+
 static void xusb_handle_register(struct work_struct *pwork)
 {
 	struct xusb_context *ctx =
@@ -106,12 +634,16 @@ static void xusb_handle_register(struct work_struct *pwork)
 
 	XINPUT_GAMEPAD *Gamepad = &ctx->device->caps->Gamepad;
 
-	struct input_dev* input_dev = input_allocate_device();
+	struct input_dev* input_dev;
+
+	xusb_assign_index(ctx);
+
+	input_dev = input_allocate_device();
 
 	if (!input_dev) {
 		printk(KERN_ERR "Failed to allocate device!\n");
 
-		return;
+		goto out;
 	}
 
 	for (int i = 0; i < xinput_button_table_sz; ++i) {
@@ -141,174 +673,2991 @@ static void xusb_handle_register(struct work_struct *pwork)
 	xusb_setup_analog(input_dev, ABS_RX, Gamepad->sThumbRX);
 	xusb_setup_analog(input_dev, ABS_RY, Gamepad->sThumbRY);
 
+	if (ctx->device->flags & XUSB_DEVICE_ANALOG_BUTTONS) {
+		for (int i = 0; i < XUSB_ANALOG_BUTTONS; ++i) {
+			xusb_setup_trigger(input_dev,
+			  xinput_analog_to_codes[i], 255);
+		}
+	}
+
+	if (ctx->device->caps->Flags & XINPUT_CAPS_FFB_SUPPORTED) {
+		input_set_capability(input_dev, EV_FF, FF_RUMBLE);
+
+		if (input_ff_create_memless(input_dev, ctx, xusb_play_effect)) {
+			printk(KERN_ERR "Failed to set up force feedback!\n");
+			input_free_device(input_dev);
+			goto out;
+		}
+	}
+
 	input_dev->name = ctx->device->name;
+	input_dev->dev.parent = &ctx->ep->intf->dev;
 
 	if (input_register_device(input_dev) != 0) {
 		printk(KERN_ERR "Failed to register input device!\n");
 		input_free_device(input_dev);
-		return;
+		goto out;
 	}
 
-	ctx->input_dev = input_dev;
+	/* Pairs with xusb_handle_input(). Then have it replay whatever
+	   arrived while we were busy. */
+	smp_store_release(&ctx->input_dev, input_dev);
+	xusb_queue_work(ctx, xusb_wq, &ctx->input_work);
 
-	if (ctx->index != XINPUT_INVALID) {
-		ctx->driver->set_led(ctx->user_data,
-	  	    XINPUT_LED_ON_1 + ctx->index);
-	}
+	printk(KERN_DEBUG "Controller %d registered %lld us after probe\n",
+	  ctx->index, ktime_us_delta(ktime_get(), ctx->probe_time));
+
+	xusb_register_led(ctx);
+	xusb_update_player_led(ctx);
+
+out:
+	xusb_context_put(ctx);
 }
 
-static void xusb_handle_unregister(struct work_struct *pwork)
+static void xusb_register_chatpad(struct xusb_context *ctx)
 {
-	struct xusb_context *ctx =
-	  container_of(pwork, struct xusb_context, unregister_work);
+	struct input_dev *input_dev = input_allocate_device();
 
-	input_unregister_device(ctx->input_dev);
-	ctx->input_dev = 0;
-	ctx->user_data = 0;
-	ctx->driver = 0;
+	if (!input_dev) {
+		printk(KERN_ERR "Failed to allocate chatpad device!\n");
+		return;
+	}
 
-	kfree(ctx);
-}
+	for (int i = 0; i < ARRAY_SIZE(xusb_chatpad_keys); ++i) {
+		if (xusb_chatpad_keys[i])
+			input_set_capability(input_dev, EV_KEY, xusb_chatpad_keys[i]);
+	}
 
-static void xusb_handle_input(struct work_struct *pwork)
-{
-	struct xusb_input_work *ctx =
-	  container_of(pwork, struct xusb_input_work, work);
+	for (int i = 0; i < ARRAY_SIZE(xusb_chatpad_modifiers); ++i)
+		input_set_capability(input_dev, EV_KEY, xusb_chatpad_modifiers[i]);
 
-	u16 buttons;
+	/* Let the input core do key repeat. */
+	__set_bit(EV_REP, input_dev->evbit);
+
+	input_dev->name = "Xbox 360 Chatpad";
+	input_dev->dev.parent = &ctx->ep->intf->dev;
 
-	if (!ctx->input_dev) {
-		printk(KERN_ERR "Attempt to handle input for invalid input device!");
+	if (input_register_device(input_dev) != 0) {
+		printk(KERN_ERR "Failed to register chatpad device!\n");
+		input_free_device(input_dev);
 		return;
 	}
 
-	buttons = ctx->input.wButtons;
-	/* The Input Subsystem checks for reported features each
-	   time we submit an event. Inefficient but works for our case. */
-	for (int i = 0; i < xinput_button_table_sz; ++i) {
-		input_report_key(
-		  ctx->input_dev,
-		  xinput_to_codes[i],
-		  buttons & xinput_button_table[i]);
-	}
+	/* Pairs with xusb_handle_chatpad_input(). */
+	smp_store_release(&ctx->chatpad_dev, input_dev);
+}
 
-	input_report_abs(ctx->input_dev, ABS_HAT0X,
-		!!(buttons & XINPUT_GAMEPAD_DPAD_RIGHT) - !!(buttons & XINPUT_GAMEPAD_DPAD_LEFT));
+/* Must be called from xusb_register_wq. */
+static void xusb_remove_chatpad(struct xusb_context *ctx)
+{
+	struct input_dev *input_dev = ctx->chatpad_dev;
 
-	input_report_abs(ctx->input_dev, ABS_HAT0Y,
-		!!(buttons & XINPUT_GAMEPAD_DPAD_DOWN) - !!(buttons & XINPUT_GAMEPAD_DPAD_UP));
+	might_sleep();
+
+	if (!input_dev)
+		return;
 
-	input_report_abs(ctx->input_dev, ABS_Z, ctx->input.bLeftTrigger);
-	input_report_abs(ctx->input_dev, ABS_RZ, ctx->input.bRightTrigger);
+	/* Let input work already using it finish first. */
+	smp_store_release(&ctx->chatpad_dev, NULL);
+	flush_work(&ctx->input_work);
 
-	input_report_abs(ctx->input_dev, ABS_X, ctx->input.sThumbLX);
-	input_report_abs(ctx->input_dev, ABS_Y, ctx->input.sThumbLY);
-	input_report_abs(ctx->input_dev, ABS_RX, ctx->input.sThumbRX);
-	input_report_abs(ctx->input_dev, ABS_RY, ctx->input.sThumbRY);
+	input_unregister_device(input_dev);
+}
 
-	input_sync(ctx->input_dev);
+static void xusb_handle_chatpad(struct work_struct *pwork)
+{
+	struct xusb_context *ctx =
+	  container_of(pwork, struct xusb_context, chatpad_work);
+
+	/* Might have flipped more than once while we were queued. */
+	if (READ_ONCE(ctx->chatpad_attached)) {
+		if (!ctx->chatpad_dev)
+			xusb_register_chatpad(ctx);
+	} else {
+		xusb_remove_chatpad(ctx);
+	}
 
-	kfree(ctx);
+	xusb_context_put(ctx);
 }
 
-struct xusb_context *xusb_register_device(
-  struct xusb_driver *driver,
-  struct xusb_device *device,
-  void *user_data)
+static void xusb_handle_unregister(struct work_struct *pwork)
 {
-	int index = XINPUT_INVALID;
-	unsigned long flags;
-	struct xusb_context *ctx;
+	struct xusb_context *ctx =
+	  container_of(pwork, struct xusb_context, unregister_work);
 
-	/* FIXME: Should be allocated from a pre-allocated pool
-	          specific to the xusb module.  */
-	ctx = kmalloc(sizeof(struct xusb_context), GFP_ATOMIC);
+	xusb_release_index(ctx);
 
-	spin_lock_irqsave(&xusb_index_lock, flags);
+	/* xusb_set_vibration() may still be calling into the driver
+	   through an index lookup. The transport frees user_data as
+	   soon as we're flushed. */
+	synchronize_rcu();
 
-	for (int i = 0; i < XINPUT_LIMIT; ++i) {
-		if (xusb_index[i] == 0) {
-			index = i;
-			break;
-		}
+	if (ctx->led_registered) {
+		led_classdev_unregister(&ctx->led);
+		ctx->led_registered = false;
 	}
 
-	printk("Assigning controller index %d", index);
+	/* Nothing can queue more input after unregister, and register
+	   work ran before us on the same queue, so this is the last. */
+	flush_work(&ctx->input_work);
 
-	if (index == XINPUT_INVALID)
-		printk("More than 4 XInput controllers connected.");
-	else
-		xusb_index[index] = ctx;
+	/* Whatever the transport last said about it. */
+	WRITE_ONCE(ctx->chatpad_attached, false);
+	xusb_remove_chatpad(ctx);
 
-	spin_unlock_irqrestore(&xusb_index_lock, flags);
+	if (ctx->input_dev)
+		input_unregister_device(ctx->input_dev);
 
-	ctx->index = index;
-	ctx->driver = driver;
-	ctx->device = device;
-	ctx->user_data = user_data;
+	ctx->input_dev = 0;
+	ctx->user_data = 0;
+	WRITE_ONCE(ctx->driver, NULL);
+	ctx->ep = 0;
 
-	INIT_WORK(&ctx->register_work, xusb_handle_register);
-	INIT_WORK(&ctx->unregister_work, xusb_handle_unregister);
+	if (ctx->input_dropped) {
+		printk(KERN_INFO "Dropped %lu input reports on controller %d\n",
+		  ctx->input_dropped, ctx->index);
+	}
 
-	queue_work(xusb_wq, &ctx->register_work);
+	if (ctx->chatpad_dropped) {
+		printk(KERN_INFO "Dropped %lu chatpad reports on controller %d\n",
+		  ctx->chatpad_dropped, ctx->index);
+	}
 
-	return ctx;
+	/* The transport's reference, handed over by
+	   xusb_unregister_device(). */
+	xusb_context_put(ctx);
 }
 
-void xusb_unregister_device(struct xusb_context *ctx)
+/* Must be called with state_lock held. Oldest keystroke is
+   dropped if the caller isn't keeping up, same as XInput. */
+static void xusb_push_keystroke(struct xusb_context *ctx,
+  u16 vk, u16 flags, ktime_t timestamp)
 {
-	unsigned long flags;
+	struct xusb_keystroke *keystroke;
+	unsigned int slot;
 
-	if (ctx->index != XINPUT_INVALID) {
-		spin_lock_irqsave(&xusb_index_lock, flags);
-		xusb_index[ctx->index] = 0;
-		spin_unlock_irqrestore(&xusb_index_lock, flags);
+	lockdep_assert_held(&ctx->state_lock);
+
+	if (ctx->keystroke_count == XUSB_KEYSTROKE_QUEUE) {
+		ctx->keystroke_head =
+		  (ctx->keystroke_head + 1) % XUSB_KEYSTROKE_QUEUE;
+		--ctx->keystroke_count;
 	}
 
-	queue_work(xusb_wq, &ctx->unregister_work);
+	slot = (ctx->keystroke_head + ctx->keystroke_count) %
+	  XUSB_KEYSTROKE_QUEUE;
+	++ctx->keystroke_count;
+
+	keystroke = &ctx->keystrokes[slot];
+	keystroke->Keystroke.VirtualKey = vk;
+	keystroke->Keystroke.Unicode = 0;
+	keystroke->Keystroke.Flags = flags;
+	keystroke->Keystroke.UserIndex = ctx->index;
+	keystroke->Keystroke.HidCode = 0;
+	keystroke->Timestamp = timestamp;
 }
 
-void xusb_report_input(struct xusb_context *ctx, const XINPUT_GAMEPAD *input)
+static void xusb_push_edge(struct xusb_context *ctx,
+  u16 vk, bool was, bool is, ktime_t timestamp)
 {
-	struct xusb_input_work *input_work =
-	kmalloc(sizeof(struct xusb_input_work), GFP_ATOMIC);
-
-	if (!input_work)
-			return;
+	if (was == is)
+		return;
 
-	input_work->input = *input;
-	input_work->input_dev = ctx->input_dev;
+	xusb_push_keystroke(ctx, vk,
+	  is ? XINPUT_KEYSTROKE_KEYDOWN : XINPUT_KEYSTROKE_KEYUP, timestamp);
+}
 
-	INIT_WORK(&input_work->work, xusb_handle_input);
+/* One per XInput index, allocated at load. See XUSB_IOC_HISTORY. */
+struct xusb_history {
+	spinlock_t lock;        /* For when compaction moves a writer */
+	struct xusb_history_header *header;
+	struct xusb_history_entry *ring;
+};
 
-	queue_work(xusb_wq, &input_work->work);
-}
+static struct xusb_history xusb_histories[XINPUT_LIMIT];
 
-void xusb_flush(void)
+static size_t xusb_history_bytes(void)
 {
-	flush_workqueue(xusb_wq);
+	return ALIGN(sizeof(struct xusb_history_header), SMP_CACHE_BYTES) +
+	  XUSB_HISTORY_SIZE * sizeof(struct xusb_history_entry);
 }
 
-EXPORT_SYMBOL_GPL(xusb_report_input);
-EXPORT_SYMBOL_GPL(xusb_unregister_device);
-EXPORT_SYMBOL_GPL(xusb_register_device);
-EXPORT_SYMBOL_GPL(xusb_flush);
-
-static int __init xusb_init(void)
+static void xusb_history_record(int index, const XINPUT_GAMEPAD *gamepad,
+  u32 packet_number, ktime_t timestamp)
+{
+	struct xusb_history *history;
+	struct xusb_history_entry *entry;
+	unsigned long flags;
+	u64 head;
+
+	if (index == XINPUT_INVALID)
+		return;
+
+	history = &xusb_histories[index];
+
+	spin_lock_irqsave(&history->lock, flags);
+
+	head = history->header->head;
+	entry = &history->ring[head % XUSB_HISTORY_SIZE];
+
+	WRITE_ONCE(entry->seq, 0);
+	smp_wmb();
+
+	entry->Timestamp = ktime_to_ns(timestamp);
+	entry->dwPacketNumber = packet_number;
+	entry->Gamepad = *gamepad;
+
+	smp_store_release(&entry->seq, head + 1);
+	smp_store_release(&history->header->head, head + 1);
+
+	spin_unlock_irqrestore(&history->lock, flags);
+}
+
+/* Returns false if the entry was overwritten or is mid-write. */
+static bool xusb_history_read(struct xusb_history *history, u64 i,
+  struct xusb_history_entry *out)
+{
+	const struct xusb_history_entry *entry =
+	  &history->ring[i % XUSB_HISTORY_SIZE];
+
+	if (smp_load_acquire(&entry->seq) != i + 1)
+		return false;
+
+	*out = data_race(*entry);
+	smp_rmb();
+
+	return READ_ONCE(entry->seq) == i + 1;
+}
+
+static int xusb_history_init(void)
+{
+	for (int i = 0; i < XINPUT_LIMIT; ++i) {
+		struct xusb_history *history = &xusb_histories[i];
+		size_t offset =
+		  ALIGN(sizeof(struct xusb_history_header), SMP_CACHE_BYTES);
+
+		/* Zeroed, so every entry starts out invalid. */
+		history->header = vmalloc_user(xusb_history_bytes());
+
+		if (!history->header) {
+			while (i--)
+				vfree(xusb_histories[i].header);
+
+			return -ENOMEM;
+		}
+
+		spin_lock_init(&history->lock);
+		history->header->size = XUSB_HISTORY_SIZE;
+		history->header->entry_size = sizeof(struct xusb_history_entry);
+		history->header->offset = offset;
+		history->ring = (void *)history->header + offset;
+	}
+
+	return 0;
+}
+
+static void xusb_history_destroy(void)
+{
+	for (int i = 0; i < XINPUT_LIMIT; ++i)
+		vfree(xusb_histories[i].header);
+}
+
+static void xusb_notify_edges(int index, const XINPUT_GAMEPAD *gamepad,
+  u32 packet, ktime_t timestamp, u16 changed);
+
+/* Records the new state and generates keystrokes from the edges.
+   Thumbstick directions aren't translated into keystrokes yet.
+   Returns whether anything changed. */
+static bool xusb_update_state(struct xusb_context *ctx,
+  const XINPUT_GAMEPAD *input, ktime_t timestamp)
+{
+	XINPUT_GAMEPAD *old = &ctx->state.State.Gamepad;
+	unsigned long flags;
+	u32 packet;
+	u16 changed;
+
+	spin_lock_irqsave(&ctx->state_lock, flags);
+
+	if (memcmp(old, input, sizeof(*input)) == 0) {
+		spin_unlock_irqrestore(&ctx->state_lock, flags);
+		return false;
+	}
+
+	changed = old->wButtons ^ input->wButtons;
+
+	for (int i = 0; i < 16; ++i) {
+		if (!(changed & (1 << i)) || !xinput_button_to_vk[i])
+			continue;
+
+		xusb_push_edge(ctx, xinput_button_to_vk[i],
+		  old->wButtons & (1 << i), input->wButtons & (1 << i),
+		  timestamp);
+	}
+
+	xusb_push_edge(ctx, VK_PAD_LTRIGGER,
+	  old->bLeftTrigger > XINPUT_GAMEPAD_TRIGGER_THRESHOLD,
+	  input->bLeftTrigger > XINPUT_GAMEPAD_TRIGGER_THRESHOLD,
+	  timestamp);
+
+	xusb_push_edge(ctx, VK_PAD_RTRIGGER,
+	  old->bRightTrigger > XINPUT_GAMEPAD_TRIGGER_THRESHOLD,
+	  input->bRightTrigger > XINPUT_GAMEPAD_TRIGGER_THRESHOLD,
+	  timestamp);
+
+	write_seqcount_begin(&ctx->state_seq);
+	*old = *input;
+	ctx->state.State.dwPacketNumber++;
+	ctx->state.Timestamp = timestamp;
+	write_seqcount_end(&ctx->state_seq);
+
+	packet = ctx->state.State.dwPacketNumber;
+	xusb_history_record(READ_ONCE(ctx->index), input, packet, timestamp);
+
+	spin_unlock_irqrestore(&ctx->state_lock, flags);
+
+	if (changed)
+		xusb_notify_edges(READ_ONCE(ctx->index),
+		  input, packet, timestamp, changed);
+
+	return true;
+}
+
+/* Enough for a few presses and releases on every pad between reads. */
+#define XUSB_CLIENT_EDGES 32
+
+/* An open /dev/xusb. Clients are on an RCU list so notifying them
+   from the input path doesn't contend with open and close. */
+struct xusb_client {
+	struct list_head node;
+	struct rcu_head rcu;
+
+	spinlock_t lock;
+	u32 mask;               /* Indices to wait on */
+	u32 pending;            /* Indices changed since the last read */
+	bool ready;             /* Wakeup delivered, read won't block */
+	u64 coalesce_ns;
+	ktime_t last_wakeup;
+	bool timer_armed;
+	struct hrtimer timer;
+
+	/* Button changes queued for XUSB_IOC_SET_EDGES. */
+	u16 edge_mask;
+	unsigned int edge_head;
+	unsigned int edge_count;
+	struct xusb_event edges[XUSB_CLIENT_EDGES];
+
+	wait_queue_head_t wait;
+	struct eventfd_ctx *eventfd;
+};
+
+static LIST_HEAD(xusb_clients);
+static DEFINE_MUTEX(xusb_clients_mutex);
+
+/* Must be called with client->lock held. */
+static void xusb_client_wake(struct xusb_client *client, ktime_t now)
+{
+	lockdep_assert_held(&client->lock);
+
+	client->ready = true;
+	client->last_wakeup = now;
+
+	wake_up_interruptible(&client->wait);
+
+	if (client->eventfd)
+		eventfd_signal(client->eventfd);
+}
+
+static enum hrtimer_restart xusb_client_timer(struct hrtimer *timer)
+{
+	struct xusb_client *client =
+	  container_of(timer, struct xusb_client, timer);
+
+	unsigned long flags;
+
+	spin_lock_irqsave(&client->lock, flags);
+	client->timer_armed = false;
+
+	if (client->pending && !client->ready)
+		xusb_client_wake(client, ktime_get());
+
+	spin_unlock_irqrestore(&client->lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+/* Only the first change of a batch does anything; later ones just
+   add to pending until the client reads. */
+static void xusb_notify_clients(int index)
+{
+	struct xusb_client *client;
+	unsigned long flags;
+	ktime_t now;
+
+	if (index == XINPUT_INVALID)
+		return;
+
+	now = ktime_get();
+
+	rcu_read_lock();
+
+	list_for_each_entry_rcu(client, &xusb_clients, node) {
+		u64 elapsed;
+
+		spin_lock_irqsave(&client->lock, flags);
+
+		if (!(client->mask & BIT(index))) {
+			spin_unlock_irqrestore(&client->lock, flags);
+			continue;
+		}
+
+		client->pending |= BIT(index);
+
+		if (client->ready || client->timer_armed) {
+			spin_unlock_irqrestore(&client->lock, flags);
+			continue;
+		}
+
+		elapsed = ktime_to_ns(ktime_sub(now, client->last_wakeup));
+
+		if (elapsed >= client->coalesce_ns) {
+			xusb_client_wake(client, now);
+		} else {
+			client->timer_armed = true;
+			hrtimer_start(&client->timer,
+			  ns_to_ktime(client->coalesce_ns - elapsed),
+			  HRTIMER_MODE_REL);
+		}
+
+		spin_unlock_irqrestore(&client->lock, flags);
+	}
+
+	rcu_read_unlock();
+}
+
+/* Called for every report that changed buttons, which is rare enough
+   next to the axes that walking the clients each time is fine. Edges
+   skip coalescing; if the client falls behind, the oldest go first. */
+static void xusb_notify_edges(int index, const XINPUT_GAMEPAD *gamepad,
+  u32 packet, ktime_t timestamp, u16 changed)
+{
+	struct xusb_client *client;
+	unsigned long flags;
+
+	if (index == XINPUT_INVALID)
+		return;
+
+	rcu_read_lock();
+
+	list_for_each_entry_rcu(client, &xusb_clients, node) {
+		struct xusb_event *event;
+
+		spin_lock_irqsave(&client->lock, flags);
+
+		if (!(client->mask & BIT(index)) ||
+		    !(client->edge_mask & changed)) {
+			spin_unlock_irqrestore(&client->lock, flags);
+			continue;
+		}
+
+		if (client->edge_count == XUSB_CLIENT_EDGES) {
+			client->edge_head++;
+			client->edge_count--;
+		}
+
+		event = &client->edges[(client->edge_head + client->edge_count)
+		  % XUSB_CLIENT_EDGES];
+		client->edge_count++;
+
+		memset(event, 0, sizeof(*event));
+		event->dwUserIndex = index;
+		event->dwPacketNumber = packet;
+		event->Timestamp = ktime_to_ns(timestamp);
+		event->Gamepad = *gamepad;
+		event->Flags = XUSB_EVENT_EDGE;
+
+		if (!client->ready)
+			xusb_client_wake(client, ktime_get());
+
+		spin_unlock_irqrestore(&client->lock, flags);
+	}
+
+	rcu_read_unlock();
+}
+
+static void xusb_emit_input(struct input_dev *input_dev,
+  unsigned int device_flags, const struct xusb_report *report,
+  ktime_t timestamp)
+{
+	const XINPUT_GAMEPAD *input = &report->Gamepad;
+	u16 buttons;
+
+	/* Events should carry the time the packet arrived, not
+	   the time we got around to processing it. */
+	input_set_timestamp(input_dev, timestamp);
+
+	buttons = input->wButtons;
+	/* The Input Subsystem checks for reported features each
+	   time we submit an event. Inefficient but works for our case. */
+	for (int i = 0; i < xinput_button_table_sz; ++i) {
+		input_report_key(
+		  input_dev,
+		  xinput_to_codes[i],
+		  buttons & xinput_button_table[i]);
+	}
+
+	input_report_abs(input_dev, ABS_HAT0X,
+		!!(buttons & XINPUT_GAMEPAD_DPAD_RIGHT) - !!(buttons & XINPUT_GAMEPAD_DPAD_LEFT));
+
+	input_report_abs(input_dev, ABS_HAT0Y,
+		!!(buttons & XINPUT_GAMEPAD_DPAD_DOWN) - !!(buttons & XINPUT_GAMEPAD_DPAD_UP));
+
+	input_report_abs(input_dev, ABS_Z, input->bLeftTrigger);
+	input_report_abs(input_dev, ABS_RZ, input->bRightTrigger);
+
+	input_report_abs(input_dev, ABS_X, input->sThumbLX);
+	input_report_abs(input_dev, ABS_Y, input->sThumbLY);
+	input_report_abs(input_dev, ABS_RX, input->sThumbRX);
+	input_report_abs(input_dev, ABS_RY, input->sThumbRY);
+
+	if (device_flags & XUSB_DEVICE_ANALOG_BUTTONS) {
+		for (int i = 0; i < XUSB_ANALOG_BUTTONS; ++i) {
+			input_report_abs(input_dev, xinput_analog_to_codes[i],
+			  report->bAnalogButtons[i]);
+		}
+	}
+
+	input_sync(input_dev);
+}
+
+static bool xusb_merge_stick_active(s16 x, s16 y, int deadzone)
+{
+	return abs(x) > deadzone || abs(y) > deadzone;
+}
+
+/* Must be called with xusb_merge_lock held. */
+static void xusb_merge_combine(int primary, struct xusb_report *out)
+{
+	bool left = false, right = false;
+
+	lockdep_assert_held(&xusb_merge_lock);
+
+	memset(out, 0, sizeof(*out));
+
+	for (int n = 0; n < XINPUT_LIMIT; ++n) {
+		int i = (primary + n) % XINPUT_LIMIT;
+		const struct xusb_report *in = &xusb_merge_latest[i];
+
+		if (xusb_merge_targets[i] != primary ||
+		    !test_bit(i, &xusb_merge_have))
+			continue;
+
+		out->Gamepad.wButtons |= in->Gamepad.wButtons;
+		out->Gamepad.bLeftTrigger =
+		  max(out->Gamepad.bLeftTrigger, in->Gamepad.bLeftTrigger);
+		out->Gamepad.bRightTrigger =
+		  max(out->Gamepad.bRightTrigger, in->Gamepad.bRightTrigger);
+
+		for (int k = 0; k < XUSB_ANALOG_BUTTONS; ++k) {
+			out->bAnalogButtons[k] =
+			  max(out->bAnalogButtons[k], in->bAnalogButtons[k]);
+		}
+
+		if (!left && xusb_merge_stick_active(in->Gamepad.sThumbLX,
+		    in->Gamepad.sThumbLY, XINPUT_GAMEPAD_LEFT_THUMB_DEADZONE)) {
+			out->Gamepad.sThumbLX = in->Gamepad.sThumbLX;
+			out->Gamepad.sThumbLY = in->Gamepad.sThumbLY;
+			left = true;
+		}
+
+		if (!right && xusb_merge_stick_active(in->Gamepad.sThumbRX,
+		    in->Gamepad.sThumbRY, XINPUT_GAMEPAD_RIGHT_THUMB_DEADZONE)) {
+			out->Gamepad.sThumbRX = in->Gamepad.sThumbRX;
+			out->Gamepad.sThumbRY = in->Gamepad.sThumbRY;
+			right = true;
+		}
+	}
+}
+
+/* Called from input work for a pad in a group, primary included.
+   The combined report is put together under the spinlock and
+   emitted after dropping it, under the emit mutex so reports from
+   pads on different CPUs can't interleave. */
+static void xusb_merge_input(struct xusb_context *ctx,
+  const struct xusb_report *report, ktime_t timestamp)
+{
+	struct xusb_context *primary;
+	struct input_dev *input_dev;
+	struct xusb_report merged;
+	unsigned long flags;
+	bool changed = false;
+	int index, target;
+
+	mutex_lock(&xusb_merge_emit_mutex);
+
+	/* Compaction can't move it while we hold the mutex. */
+	index = READ_ONCE(ctx->index);
+	if (index == XINPUT_INVALID)
+		goto out;
+
+	spin_lock_irqsave(&xusb_merge_lock, flags);
+
+	/* Regrouped since the caller looked. Drop this one. */
+	target = xusb_merge_targets[index];
+	if (target >= 0) {
+		xusb_merge_latest[index] = *report;
+		set_bit(index, &xusb_merge_have);
+		xusb_merge_combine(target, &merged);
+	}
+
+	spin_unlock_irqrestore(&xusb_merge_lock, flags);
+
+	if (target < 0)
+		goto out;
+
+	/* Its input_dev stays registered until after an RCU grace
+	   period following the index being released. */
+	rcu_read_lock();
+
+	primary = xusb_lookup(target);
+	if (primary) {
+		changed = xusb_update_state(primary, &merged.Gamepad,
+		  timestamp);
+
+		input_dev = smp_load_acquire(&primary->input_dev);
+
+		if (input_dev) {
+			xusb_emit_input(input_dev, primary->device->flags,
+			  &merged, timestamp);
+		}
+	}
+
+	rcu_read_unlock();
+
+	if (changed)
+		xusb_notify_clients(target);
+
+out:
+	mutex_unlock(&xusb_merge_emit_mutex);
+}
+
+static void xusb_emit_chatpad(struct input_dev *input_dev,
+  const struct xusb_chatpad_report *old,
+  const struct xusb_chatpad_report *new, ktime_t timestamp)
+{
+	u8 changed = old->modifiers ^ new->modifiers;
+
+	input_set_timestamp(input_dev, timestamp);
+
+	for (int i = 0; i < ARRAY_SIZE(xusb_chatpad_modifiers); ++i) {
+		if (changed & BIT(i)) {
+			input_report_key(input_dev, xusb_chatpad_modifiers[i],
+			  new->modifiers & BIT(i));
+		}
+	}
+
+	/* Releases first, so a rolled key reads as up then down. */
+	for (int i = 0; i < 2; ++i) {
+		u8 key = old->keys[i];
+
+		if (key && key != new->keys[0] && key != new->keys[1] &&
+		    xusb_chatpad_keys[key])
+			input_report_key(input_dev, xusb_chatpad_keys[key], 0);
+	}
+
+	for (int i = 0; i < 2; ++i) {
+		u8 key = new->keys[i];
+
+		if (key && key != old->keys[0] && key != old->keys[1] &&
+		    xusb_chatpad_keys[key])
+			input_report_key(input_dev, xusb_chatpad_keys[key], 1);
+	}
+
+	input_sync(input_dev);
+}
+
+/* Called from input_work. */
+static void xusb_handle_chatpad_input(struct xusb_context *ctx)
+{
+	struct input_dev *input_dev = smp_load_acquire(&ctx->chatpad_dev);
+	unsigned int head = smp_load_acquire(&ctx->chatpad_head);
+	unsigned int tail = ctx->chatpad_tail;
+
+	for (; tail != head; ++tail) {
+		struct xusb_chatpad_slot *slot =
+		  &ctx->chatpad_queue[tail % XUSB_CHATPAD_QUEUE];
+
+		/* Without a device, keys pressed now will show up as
+		   pressed once there is one. */
+		if (!input_dev)
+			continue;
+
+		xusb_emit_chatpad(input_dev, &ctx->chatpad_last,
+		  &slot->report, slot->timestamp);
+		ctx->chatpad_last = slot->report;
+	}
+
+	smp_store_release(&ctx->chatpad_tail, tail);
+}
+
+/* BPF remapping
+
+   xusb_bpf_remap() is called on every report between the transport
+   parsing it and xusb emitting it. It does nothing by itself. Attach
+   an fmod_ret program to it (SEC("fmod_ret/xusb_bpf_remap")) and the
+   program can rewrite the report through xusb_bpf_get_data() before
+   anyone sees it: swap buttons, reshape stick curves, whatever. A
+   nonzero return drops the report. The program runs for every pad
+   and picks its own out of ctx->index, and it's detached when its
+   link's file descriptor is closed.
+
+   This is the same approach HID-BPF started out with. With nothing
+   attached it costs a call to an empty function. __weak keeps the
+   compiler from assuming it always returns 0. */
+__bpf_hook_start();
+
+__weak noinline int xusb_bpf_remap(struct xusb_bpf_ctx *ctx)
+{
+	return 0;
+}
+
+__bpf_hook_end();
+
+__bpf_kfunc_start_defs();
+
+/* rdwr_buf_size has to be a constant, the verifier uses it as the
+   size of the memory the program gets back. */
+__bpf_kfunc u8 *xusb_bpf_get_data(struct xusb_bpf_ctx *ctx,
+  unsigned int offset, const size_t rdwr_buf_size)
+{
+	if (offset > sizeof(*ctx->report) ||
+	    rdwr_buf_size > sizeof(*ctx->report) - offset)
+		return NULL;
+
+	return (u8 *)ctx->report + offset;
+}
+
+__bpf_kfunc_end_defs();
+
+#ifdef CONFIG_BPF_SYSCALL
+BTF_KFUNCS_START(xusb_bpf_kfunc_ids)
+BTF_ID_FLAGS(func, xusb_bpf_get_data, KF_RET_NULL)
+BTF_KFUNCS_END(xusb_bpf_kfunc_ids)
+
+static const struct btf_kfunc_id_set xusb_bpf_kfunc_set = {
+	.owner = THIS_MODULE,
+	.set = &xusb_bpf_kfunc_ids,
+};
+
+BTF_SET8_START(xusb_bpf_fmodret_ids)
+BTF_ID_FLAGS(func, xusb_bpf_remap)
+BTF_SET8_END(xusb_bpf_fmodret_ids)
+
+static const struct btf_kfunc_id_set xusb_bpf_fmodret_set = {
+	.owner = THIS_MODULE,
+	.set = &xusb_bpf_fmodret_ids,
+};
+
+/* Without BTF for modules there's nothing to attach to, which isn't
+   worth failing the load over. */
+static void xusb_bpf_init(void)
+{
+	int error;
+
+	error = register_btf_fmodret_id_set(&xusb_bpf_fmodret_set);
+
+	if (!error) {
+		error = register_btf_kfunc_id_set(BPF_PROG_TYPE_TRACING,
+		  &xusb_bpf_kfunc_set);
+	}
+
+	if (error)
+		printk(KERN_WARNING "BPF remapping unavailable: %d\n", error);
+}
+#else
+static void xusb_bpf_init(void)
+{
+}
+#endif
+
+static void xusb_note_first_event(struct xusb_context *ctx,
+  ktime_t timestamp)
+{
+	printk(KERN_DEBUG "Controller %d first event %lld us after probe, "
+	  "%lld us after it arrived\n", ctx->index,
+	  ktime_us_delta(ktime_get(), ctx->probe_time),
+	  ktime_us_delta(ktime_get(), timestamp));
+}
+
+static void xusb_handle_input(struct work_struct *pwork)
+{
+	struct xusb_context *ctx =
+	  container_of(pwork, struct xusb_context, input_work);
+
+	/* Pairs with xusb_handle_register(). NULL until it's done, in
+	   which case only the XInput state is updated. */
+	struct input_dev *input_dev = smp_load_acquire(&ctx->input_dev);
+
+	unsigned int head = smp_load_acquire(&ctx->input_head);
+	unsigned int tail = ctx->input_tail;
+	bool changed = false;
+
+	/* Checked once per batch; a regroup takes effect on the next. */
+	bool merged = xusb_merge_target(READ_ONCE(ctx->index)) >= 0;
+
+	/* Catch evdev up on what it missed. Reports in the queue will
+	   follow right after, so only the latest one matters. */
+	if (input_dev && !ctx->replayed) {
+		ctx->replayed = true;
+
+		if (ctx->have_report && tail == head) {
+			xusb_emit_input(input_dev, ctx->device->flags,
+			  &ctx->last_report, ctx->last_timestamp);
+			xusb_note_first_event(ctx, ctx->last_timestamp);
+		} else if (tail != head) {
+			xusb_note_first_event(ctx,
+			  ctx->input_queue[tail % XUSB_INPUT_QUEUE].timestamp);
+		}
+	}
+
+	for (; tail != head; ++tail) {
+		struct xusb_input_slot *slot =
+		  &ctx->input_queue[tail % XUSB_INPUT_QUEUE];
+
+		struct xusb_bpf_ctx bpf_ctx = {
+			.index = READ_ONCE(ctx->index),
+			.device_flags = ctx->device->flags,
+			.timestamp = slot->timestamp,
+			.report = &slot->report
+		};
+
+		if (xusb_bpf_remap(&bpf_ctx))
+			continue;
+
+		if (merged) {
+			xusb_merge_input(ctx, &slot->report, slot->timestamp);
+			continue;
+		}
+
+		changed |= xusb_update_state(ctx,
+		  &slot->report.Gamepad, slot->timestamp);
+
+		if (input_dev) {
+			xusb_emit_input(input_dev, ctx->device->flags,
+			  &slot->report, slot->timestamp);
+		} else {
+			ctx->last_report = slot->report;
+			ctx->last_timestamp = slot->timestamp;
+			ctx->have_report = true;
+		}
+	}
+
+	/* Hands the slots back to the producer. */
+	smp_store_release(&ctx->input_tail, tail);
+
+	xusb_handle_chatpad_input(ctx);
+
+	/* Once per batch, not per report. */
+	if (changed)
+		xusb_notify_clients(READ_ONCE(ctx->index));
+
+	xusb_context_put(ctx);
+}
+
+/* Flight recorder
+
+   Every endpoint keeps its last XUSB_RECORDER_SIZE reports, drops,
+   URB errors and unknown packets in a ring that's never locked.
+   Writers claim a slot with an atomic increment and mark it
+   complete through seq; readers skip anything torn or overwritten.
+   It's readable live from debugfs (xusb/<interface>/recorder). When
+   something goes wrong a copy is taken into snapshot so it doesn't
+   scroll away before anyone looks; writing to snapshot takes one by
+   hand. */
+
+/* Unknown packets this close together count as a burst. */
+#define XUSB_UNKNOWN_BURST 16
+#define XUSB_UNKNOWN_WINDOW_NS (100 * NSEC_PER_MSEC)
+
+/* Automatic snapshots are at most this often per endpoint. */
+#define XUSB_SNAPSHOT_INTERVAL (5 * HZ)
+
+static struct dentry *xusb_debugfs;
+
+static void xusb_record(struct xusb_recorder *rec, u32 type, s32 code,
+  ktime_t time, const XINPUT_GAMEPAD *gamepad)
+{
+	unsigned int index = atomic_fetch_inc(&rec->head);
+	struct xusb_record *record = &rec->ring[index % XUSB_RECORDER_SIZE];
+
+	WRITE_ONCE(record->seq, 0);
+	smp_wmb();
+
+	record->type = type;
+	record->time_ns = ktime_to_ns(time);
+	record->code = code;
+
+	if (gamepad)
+		record->Gamepad = *gamepad;
+	else
+		memset(&record->Gamepad, 0, sizeof(record->Gamepad));
+
+	smp_store_release(&record->seq, index + 1);
+}
+
+/* Returns false if the slot is mid-write or no longer holds index. */
+static bool xusb_record_read(const struct xusb_record *record,
+  unsigned int index, struct xusb_record *out)
+{
+	if (smp_load_acquire(&record->seq) != index + 1)
+		return false;
+
+	*out = data_race(*record);
+	smp_rmb();
+
+	return READ_ONCE(record->seq) == index + 1;
+}
+
+static void xusb_recorder_snapshot(struct xusb_recorder *rec,
+  const char *reason)
+{
+	mutex_lock(&rec->snapshot_lock);
+
+	rec->snapshot_head = atomic_read(&rec->head);
+	memcpy(rec->snapshot, rec->ring,
+	  sizeof(*rec->ring) * XUSB_RECORDER_SIZE);
+	rec->snapshot_reason = reason;
+	rec->snapshot_time = ktime_get();
+
+	mutex_unlock(&rec->snapshot_lock);
+}
+
+static void xusb_recorder_work(struct work_struct *pwork)
+{
+	struct xusb_recorder *rec =
+	  container_of(pwork, struct xusb_recorder, work);
+
+	struct xusb_endpoint *ep =
+	  container_of(rec, struct xusb_endpoint, recorder);
+
+	const char *reason = READ_ONCE(rec->pending_reason);
+
+	if (rec->last_snapshot &&
+	    time_before(jiffies, rec->last_snapshot + XUSB_SNAPSHOT_INTERVAL))
+		return;
+
+	rec->last_snapshot = jiffies;
+
+	xusb_recorder_snapshot(rec, reason);
+
+	printk(KERN_WARNING "%s: %s, recorder snapshot saved\n",
+	  dev_name(&ep->intf->dev), reason);
+}
+
+/* Safe from the completion handler. */
+static void xusb_recorder_trigger(struct xusb_recorder *rec,
+  const char *reason)
+{
+	if (work_pending(&rec->work))
+		return;
+
+	WRITE_ONCE(rec->pending_reason, reason);
+	schedule_work(&rec->work);
+}
+
+static const char *const xusb_record_names[] = {
+	[XUSB_RECORD_REPORT] = "report",
+	[XUSB_RECORD_DROP] = "drop",
+	[XUSB_RECORD_URB_ERROR] = "urb-error",
+	[XUSB_RECORD_UNKNOWN] = "unknown",
+};
+
+static void xusb_recorder_dump(struct seq_file *m,
+  const struct xusb_record *ring, unsigned int head)
+{
+	unsigned int start = 0;
+
+	if (head > XUSB_RECORDER_SIZE)
+		start = head - XUSB_RECORDER_SIZE;
+
+	seq_puts(m, "# time type code buttons lt rt lx ly rx ry\n");
+
+	for (unsigned int i = start; i != head; ++i) {
+		struct xusb_record r;
+		const char *name = "?";
+		s64 sec;
+		s32 nsec;
+
+		if (!xusb_record_read(&ring[i % XUSB_RECORDER_SIZE], i, &r))
+			continue;
+
+		if (r.type < ARRAY_SIZE(xusb_record_names))
+			name = xusb_record_names[r.type];
+
+		sec = div_s64_rem(r.time_ns, NSEC_PER_SEC, &nsec);
+
+		seq_printf(m, "%lld.%09d %s %d %04x %u %u %d %d %d %d\n",
+		  sec, nsec, name, r.code, r.Gamepad.wButtons,
+		  r.Gamepad.bLeftTrigger, r.Gamepad.bRightTrigger,
+		  r.Gamepad.sThumbLX, r.Gamepad.sThumbLY,
+		  r.Gamepad.sThumbRX, r.Gamepad.sThumbRY);
+	}
+}
+
+static int xusb_recorder_show(struct seq_file *m, void *unused)
+{
+	struct xusb_recorder *rec = m->private;
+
+	xusb_recorder_dump(m, rec->ring, atomic_read(&rec->head));
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(xusb_recorder);
+
+static int xusb_snapshot_show(struct seq_file *m, void *unused)
+{
+	struct xusb_recorder *rec = m->private;
+
+	mutex_lock(&rec->snapshot_lock);
+
+	if (rec->snapshot_reason) {
+		seq_printf(m, "# %s at %lld\n", rec->snapshot_reason,
+		  ktime_to_ns(rec->snapshot_time));
+		xusb_recorder_dump(m, rec->snapshot, rec->snapshot_head);
+	}
+
+	mutex_unlock(&rec->snapshot_lock);
+
+	return 0;
+}
+
+static int xusb_snapshot_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, xusb_snapshot_show, inode->i_private);
+}
+
+static ssize_t xusb_snapshot_write(struct file *file,
+  const char __user *buffer, size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+
+	xusb_recorder_snapshot(m->private, "requested");
+
+	return count;
+}
+
+static const struct file_operations xusb_snapshot_fops = {
+	.owner = THIS_MODULE,
+	.open = xusb_snapshot_open,
+	.read = seq_read,
+	.write = xusb_snapshot_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int xusb_recorder_init(struct xusb_recorder *rec,
+  struct usb_interface *intf)
+{
+	rec->ring = kvcalloc(XUSB_RECORDER_SIZE, sizeof(*rec->ring),
+	  GFP_KERNEL);
+	rec->snapshot = kvcalloc(XUSB_RECORDER_SIZE, sizeof(*rec->snapshot),
+	  GFP_KERNEL);
+
+	if (!rec->ring || !rec->snapshot) {
+		kvfree(rec->ring);
+		kvfree(rec->snapshot);
+		return -ENOMEM;
+	}
+
+	atomic_set(&rec->head, 0);
+	mutex_init(&rec->snapshot_lock);
+	rec->snapshot_head = 0;
+	rec->snapshot_reason = NULL;
+	rec->last_snapshot = 0;
+	rec->pending_reason = NULL;
+	rec->unknown_start = 0;
+	rec->unknown_count = 0;
+	INIT_WORK(&rec->work, xusb_recorder_work);
+
+	rec->debugfs = debugfs_create_dir(dev_name(&intf->dev), xusb_debugfs);
+	debugfs_create_file("recorder", 0400, rec->debugfs, rec,
+	  &xusb_recorder_fops);
+	debugfs_create_file("snapshot", 0600, rec->debugfs, rec,
+	  &xusb_snapshot_fops);
+
+	return 0;
+}
+
+static void xusb_recorder_destroy(struct xusb_recorder *rec)
+{
+	debugfs_remove(rec->debugfs);
+	cancel_work_sync(&rec->work);
+
+	kvfree(rec->ring);
+	kvfree(rec->snapshot);
+}
+
+void xusb_endpoint_unknown(struct xusb_endpoint *ep, s32 code)
+{
+	struct xusb_recorder *rec = &ep->recorder;
+	ktime_t now = ktime_get();
+
+	xusb_record(rec, XUSB_RECORD_UNKNOWN, code, now, NULL);
+
+	if (ktime_to_ns(ktime_sub(now, rec->unknown_start)) >
+	    XUSB_UNKNOWN_WINDOW_NS) {
+		rec->unknown_start = now;
+		rec->unknown_count = 0;
+	}
+
+	if (++rec->unknown_count == XUSB_UNKNOWN_BURST)
+		xusb_recorder_trigger(rec, "burst of unknown packets");
+}
+
+struct xusb_context *xusb_register_device(
+  struct xusb_endpoint *ep,
+  struct xusb_driver *driver,
+  struct xusb_device *device,
+  void *user_data)
+{
+	struct xusb_context *ctx;
+
+	ctx = xusb_context_alloc();
+
+	if (!ctx) {
+		printk(KERN_ERR "No free xusb contexts, ignoring device.\n");
+		return NULL;
+	}
+
+	kref_init(&ctx->ref);
+
+	ctx->index = XINPUT_INVALID;
+	ctx->driver = driver;
+	ctx->device = device;
+	ctx->user_data = user_data;
+	ctx->ep = ep;
+	ctx->input_dev = 0;
+	ctx->led_registered = false;
+	ctx->have_report = false;
+	ctx->replayed = false;
+	ctx->probe_time = ktime_get();
+
+	ctx->input_head = 0;
+	ctx->input_tail = 0;
+	ctx->input_dropped = 0;
+	ctx->have_committed = false;
+
+	ctx->chatpad_dev = 0;
+	ctx->chatpad_attached = false;
+	ctx->chatpad_head = 0;
+	ctx->chatpad_tail = 0;
+	ctx->chatpad_dropped = 0;
+	memset(&ctx->chatpad_last, 0, sizeof(ctx->chatpad_last));
+
+	spin_lock_init(&ctx->state_lock);
+	seqcount_spinlock_init(&ctx->state_seq, &ctx->state_lock);
+	memset(&ctx->state, 0, sizeof(ctx->state));
+	ctx->keystroke_head = 0;
+	ctx->keystroke_count = 0;
+
+	INIT_WORK(&ctx->register_work, xusb_handle_register);
+	INIT_WORK(&ctx->unregister_work, xusb_handle_unregister);
+	INIT_WORK(&ctx->input_work, xusb_handle_input);
+	INIT_WORK(&ctx->chatpad_work, xusb_handle_chatpad);
+
+	/* The index is assigned by the register work. Input is
+	   accepted right away regardless. */
+	xusb_queue_work(ctx, xusb_register_wq, &ctx->register_work);
+
+	return ctx;
+}
+
+void xusb_unregister_device(struct xusb_context *ctx)
+{
+	/* Transfers the transport's reference to the work item. */
+	queue_work(xusb_register_wq, &ctx->unregister_work);
+}
+
+struct xusb_report *xusb_begin_report(struct xusb_context *ctx)
+{
+	unsigned int head = ctx->input_head;
+
+	if (head - smp_load_acquire(&ctx->input_tail) >= XUSB_INPUT_QUEUE) {
+		ctx->input_dropped++;
+		xusb_record(&ctx->ep->recorder, XUSB_RECORD_DROP,
+		  ctx->input_dropped, ktime_get(), NULL);
+		return NULL;
+	}
+
+	return &ctx->input_queue[head % XUSB_INPUT_QUEUE].report;
+}
+
+void xusb_commit_report(struct xusb_context *ctx, ktime_t timestamp)
+{
+	unsigned int head = ctx->input_head;
+	struct xusb_report *report =
+	  &ctx->input_queue[head % XUSB_INPUT_QUEUE].report;
+
+	/* Nothing would come of it but a wakeup. Leaving head alone
+	   hands the slot back for the next one. */
+	size_t compare = (ctx->device->flags & XUSB_DEVICE_ANALOG_BUTTONS) ?
+	  sizeof(*report) : sizeof(report->Gamepad);
+
+	if (ctx->have_committed &&
+	    memcmp(report, &ctx->last_committed, compare) == 0) {
+		ctx->ep->identical_reports++;
+		return;
+	}
+
+	memcpy(&ctx->last_committed, report, compare);
+	ctx->have_committed = true;
+
+	ctx->input_queue[head % XUSB_INPUT_QUEUE].timestamp = timestamp;
+
+	xusb_record(&ctx->ep->recorder, XUSB_RECORD_REPORT, 0, timestamp,
+	  &ctx->input_queue[head % XUSB_INPUT_QUEUE].report.Gamepad);
+
+	/* Publishes the slot to xusb_handle_input(). */
+	smp_store_release(&ctx->input_head, head + 1);
+
+	xusb_queue_input(ctx);
+}
+
+void xusb_attach_chatpad(struct xusb_context *ctx, bool attached)
+{
+	if (READ_ONCE(ctx->chatpad_attached) == attached)
+		return;
+
+	WRITE_ONCE(ctx->chatpad_attached, attached);
+	xusb_queue_work(ctx, xusb_register_wq, &ctx->chatpad_work);
+}
+
+void xusb_report_chatpad(struct xusb_context *ctx,
+  const struct xusb_chatpad_report *report, ktime_t timestamp)
+{
+	unsigned int head = ctx->chatpad_head;
+	struct xusb_chatpad_slot *slot;
+
+	if (head - smp_load_acquire(&ctx->chatpad_tail) >= XUSB_CHATPAD_QUEUE) {
+		ctx->chatpad_dropped++;
+		return;
+	}
+
+	slot = &ctx->chatpad_queue[head % XUSB_CHATPAD_QUEUE];
+	slot->report = *report;
+	slot->timestamp = timestamp;
+
+	/* Publishes the slot to xusb_handle_chatpad_input(). */
+	smp_store_release(&ctx->chatpad_head, head + 1);
+
+	xusb_queue_input(ctx);
+}
+
+void xusb_report_input(struct xusb_context *ctx,
+  const XINPUT_GAMEPAD *input, ktime_t timestamp)
+{
+	struct xusb_report *report = xusb_begin_report(ctx);
+
+	if (!report)
+		return;
+
+	report->Gamepad = *input;
+	xusb_commit_report(ctx, timestamp);
+}
+
+int xusb_get_state(u8 index, struct xusb_state *state)
+{
+	struct xusb_context *ctx;
+	unsigned int seq;
+	int error = -ENODEV;
+
+	if (index >= XINPUT_LIMIT)
+		return -EINVAL;
+
+	/* The slot can't be reused until we leave the read section. */
+	rcu_read_lock();
+
+	ctx = xusb_lookup(index);
+	if (ctx) {
+		do {
+			seq = read_seqcount_begin(&ctx->state_seq);
+			*state = ctx->state;
+		} while (read_seqcount_retry(&ctx->state_seq, seq));
+
+		error = 0;
+	}
+
+	rcu_read_unlock();
+
+	return error;
+}
+
+int xusb_get_keystroke(u8 index, struct xusb_keystroke *keystroke)
+{
+	struct xusb_context *ctx;
+	unsigned long flags;
+	int error = -ENODEV;
+
+	if (index >= XINPUT_LIMIT)
+		return -EINVAL;
+
+	rcu_read_lock();
+
+	ctx = xusb_lookup(index);
+	if (ctx) {
+		spin_lock_irqsave(&ctx->state_lock, flags);
+
+		if (ctx->keystroke_count) {
+			*keystroke = ctx->keystrokes[ctx->keystroke_head];
+			ctx->keystroke_head =
+			  (ctx->keystroke_head + 1) % XUSB_KEYSTROKE_QUEUE;
+			--ctx->keystroke_count;
+			error = 0;
+		} else {
+			error = -EAGAIN;
+		}
+
+		spin_unlock_irqrestore(&ctx->state_lock, flags);
+	}
+
+	rcu_read_unlock();
+
+	return error;
+}
+
+int xusb_set_vibration(u8 index, const XINPUT_VIBRATION *vibration)
+{
+	struct xusb_context *ctx;
+	struct xusb_driver *driver;
+	int error = -ENODEV;
+
+	rcu_read_lock();
+
+	ctx = xusb_lookup(index);
+	driver = ctx ? READ_ONCE(ctx->driver) : NULL;
+
+	if (driver) {
+		driver->set_vibration(ctx->user_data, *vibration);
+		error = 0;
+	}
+
+	rcu_read_unlock();
+
+	if (!error)
+		xusb_vibrate_members(index, *vibration);
+
+	return error;
+}
+
+int xusb_set_trigger_vibration(u8 index, const XINPUT_VIBRATION *vibration)
+{
+	struct xusb_context *ctx;
+	struct xusb_driver *driver;
+	int error = -ENODEV;
+
+	rcu_read_lock();
+
+	ctx = xusb_lookup(index);
+	driver = ctx ? READ_ONCE(ctx->driver) : NULL;
+
+	if (driver && !driver->set_trigger_vibration) {
+		error = -EOPNOTSUPP;
+	} else if (driver) {
+		driver->set_trigger_vibration(ctx->user_data, *vibration);
+		error = 0;
+	}
+
+	rcu_read_unlock();
+
+	return error;
+}
+
+/* Raw packet tap. See XUSB_IOC_TAP in xusb.h. */
+#define XUSB_TAP_DEFAULT_FRAMES 256
+#define XUSB_TAP_MAX_FRAMES 8192
+
+struct xusb_tap {
+	struct xusb_endpoint *ep; /* NULL once the device is gone */
+
+	spinlock_t lock;        /* IN and OUT both produce */
+	unsigned int head;
+	unsigned int frames;
+
+	struct xusb_tap_header *header;
+	struct xusb_tap_frame *ring;
+
+	wait_queue_head_t wait;
+};
+
+/* Endpoints that can be tapped. Also protects ep->tap and tap->ep. */
+static LIST_HEAD(xusb_endpoints);
+static DEFINE_MUTEX(xusb_endpoints_mutex);
+
+/* Keeps xusb_tap_record() out of the completion path entirely
+   unless some endpoint somewhere is being tapped. */
+static DEFINE_STATIC_KEY_FALSE(xusb_tap_active);
+
+static void xusb_tap_record(struct xusb_endpoint *ep,
+  const u8 *data, u32 length, ktime_t timestamp, u8 flags)
+{
+	struct xusb_tap_frame *frame;
+	struct xusb_tap *tap;
+	unsigned long irq_flags;
+	u8 captured;
+
+	rcu_read_lock();
+
+	tap = rcu_dereference(ep->tap);
+	if (!tap)
+		goto out;
+
+	spin_lock_irqsave(&tap->lock, irq_flags);
+
+	frame = &tap->ring[tap->head & (tap->frames - 1)];
+
+	if (smp_load_acquire(&frame->status) != XUSB_TAP_KERNEL) {
+		WRITE_ONCE(tap->header->dropped, tap->header->dropped + 1);
+		spin_unlock_irqrestore(&tap->lock, irq_flags);
+		goto out;
+	}
+
+	captured = min_t(u32, length, XUSB_TAP_DATA_SIZE);
+
+	memcpy(frame->data, data, captured);
+	frame->length = length;
+	frame->captured = captured;
+	frame->flags = flags;
+	frame->Timestamp = ktime_to_ns(timestamp);
+
+	smp_store_release(&frame->status, XUSB_TAP_USER);
+	++tap->head;
+
+	spin_unlock_irqrestore(&tap->lock, irq_flags);
+
+	if (wq_has_sleeper(&tap->wait))
+		wake_up_interruptible(&tap->wait);
+
+out:
+	rcu_read_unlock();
+}
+
+/* Convert microseconds into what urb->interval expects, frames
+   for low/full speed and microframes for anything faster. The
+   host controller may still round this, or ignore it entirely
+   (xHCI uses the descriptor) hence poll_interval_actual. */
+static int xusb_interval_to_urb(struct usb_device *usb_dev,
+  unsigned int interval_us)
+{
+	if (usb_dev->speed >= USB_SPEED_HIGH)
+		return clamp(interval_us / 125, 1u, 1u << 15);
+
+	return clamp(interval_us / 1000, 1u, 255u);
+}
+
+/* Error recovery
+
+   A failed transfer isn't resubmitted straight from the completion
+   handler; an endpoint that keeps failing would turn that into an
+   interrupt storm. Instead the retry is delayed, doubling each time
+   it fails in a row. A stalled endpoint (-EPIPE) needs
+   usb_clear_halt(), which sleeps, so that goes through halt_work.
+   Enough failures in a row and the device gets reset, which rebinds
+   us from scratch. None of this is touched while transfers succeed
+   other than clearing in_errors. */
+#define XUSB_RETRY_MAX_MS 256
+#define XUSB_RESET_ERRORS 10
+
+#define XUSB_HALT_IN 0
+#define XUSB_HALT_OUT 1
+
+static void xusb_endpoint_in_failed(struct xusb_endpoint *ep, bool halted)
+{
+	unsigned int errors = ++ep->in_errors;
+
+	if (errors == XUSB_RESET_ERRORS) {
+		printk(KERN_WARNING "%s: %u errors in a row, resetting\n",
+		  dev_name(&ep->intf->dev), errors);
+
+		/* The URB stays idle; the reset rebinds the driver. */
+		ep->resets++;
+		usb_queue_reset_device(ep->intf);
+		return;
+	}
+
+	if (errors > XUSB_RESET_ERRORS)
+		return;
+
+	if (halted) {
+		ep->halts++;
+		set_bit(XUSB_HALT_IN, &ep->halted);
+		schedule_work(&ep->halt_work);
+		return;
+	}
+
+	hrtimer_start(&ep->retry_timer,
+	  ms_to_ktime(min(1u << (errors - 1), (unsigned int)XUSB_RETRY_MAX_MS)),
+	  HRTIMER_MODE_REL_SOFT);
+}
+
+static void xusb_endpoint_resubmit(struct xusb_endpoint *ep, gfp_t flags)
+{
+	int error = usb_submit_urb(ep->in, flags);
+
+	switch (error) {
+	case 0:
+		break;
+	case -EPERM:  /* Poisoned by xusb_endpoint_quiesce() */
+	case -ENODEV:
+	case -ESHUTDOWN:
+		break;
+	default:
+		ep->resubmit_errors++;
+		xusb_endpoint_in_failed(ep, false);
+	}
+}
+
+static enum hrtimer_restart xusb_endpoint_retry(struct hrtimer *timer)
+{
+	struct xusb_endpoint *ep =
+	  container_of(timer, struct xusb_endpoint, retry_timer);
+
+	xusb_endpoint_resubmit(ep, GFP_ATOMIC);
+
+	return HRTIMER_NORESTART;
+}
+
+static int xusb_endpoint_send_next(struct xusb_endpoint *ep);
+
+static void xusb_endpoint_halt_work(struct work_struct *pwork)
+{
+	struct xusb_endpoint *ep =
+	  container_of(pwork, struct xusb_endpoint, halt_work);
+
+	struct usb_device *usb_dev = interface_to_usbdev(ep->intf);
+	unsigned long flags;
+	int error;
+
+	if (test_and_clear_bit(XUSB_HALT_IN, &ep->halted)) {
+		error = usb_clear_halt(usb_dev, ep->in->pipe);
+
+		if (error) {
+			printk(KERN_ERR "%s: Failed to clear IN halt: %d\n",
+			  dev_name(&ep->intf->dev), error);
+		}
+
+		/* If it's still stalled this comes right back here,
+		   and counts toward a reset. */
+		xusb_endpoint_resubmit(ep, GFP_KERNEL);
+	}
+
+	if (test_and_clear_bit(XUSB_HALT_OUT, &ep->halted)) {
+		error = usb_clear_halt(usb_dev, ep->out->pipe);
+
+		if (error) {
+			printk(KERN_ERR "%s: Failed to clear OUT halt: %d\n",
+			  dev_name(&ep->intf->dev), error);
+		}
+
+		spin_lock_irqsave(&ep->out_lock, flags);
+
+		if (ep->out_enabled && !ep->out_active)
+			xusb_endpoint_send_next(ep);
+
+		spin_unlock_irqrestore(&ep->out_lock, flags);
+	}
+}
+
+/* Stops the IN URB for good, including any retry in progress, until
+   it's next submitted. Must be called with ep->lock held. */
+static void xusb_endpoint_quiesce(struct xusb_endpoint *ep)
+{
+	lockdep_assert_held(&ep->lock);
+
+	usb_poison_urb(ep->in);
+	hrtimer_cancel(&ep->retry_timer);
+
+	/* Resubmitting from here fails now; this only waits for it. */
+	flush_work(&ep->halt_work);
+
+	ep->in_errors = 0;
+	usb_unpoison_urb(ep->in);
+}
+
+/* Adaptive polling
+
+   Some pads send a report every interval whether anything changed
+   or not. Once one has sent the same bytes for idle_timeout_ms, the
+   URB is parked after each completion and resubmitted from the
+   retry timer idle_interval_ms later. The first packet that differs
+   puts it straight back to full rate, so a press from idle costs at
+   most an extra idle_interval_ms. Pads that only report on change
+   never look idle and are unaffected. */
+static bool xusb_endpoint_idle(struct xusb_endpoint *ep,
+  struct urb *urb, ktime_t timestamp)
+{
+	unsigned int timeout_ms = READ_ONCE(idle_timeout_ms);
+	u32 length = min_t(u32, urb->actual_length, XUSB_IDLE_COMPARE);
+
+	if (!timeout_ms)
+		return false;
+
+	if (length != ep->idle_length ||
+	    memcmp(urb->transfer_buffer, ep->idle_packet, length)) {
+		memcpy(ep->idle_packet, urb->transfer_buffer, length);
+		ep->idle_length = length;
+		ep->idle_since = timestamp;
+		return false;
+	}
+
+	return ktime_ms_delta(timestamp, ep->idle_since) >= timeout_ms;
+}
+
+static void xusb_endpoint_irq(struct urb *urb)
+{
+	struct xusb_endpoint *ep = urb->context;
+	ktime_t timestamp = ktime_get();
+
+	switch (urb->status) {
+	case 0:
+		if (unlikely(ep->in_errors))
+			ep->in_errors = 0;
+		break;
+	case -ECONNRESET:
+	case -ENOENT:
+	case -ESHUTDOWN:
+		return;
+	default:
+		xusb_record(&ep->recorder, XUSB_RECORD_URB_ERROR,
+		  urb->status, timestamp, NULL);
+		xusb_recorder_trigger(&ep->recorder, "URB error");
+
+		ep->urb_errors++;
+		xusb_endpoint_in_failed(ep, urb->status == -EPIPE);
+		return;
+	}
+
+	if (ep->last_complete) {
+		s64 delta = ktime_to_ns(ktime_sub(timestamp, ep->last_complete));
+
+		/* 1/8 weight, same as the TCP RTT estimator. */
+		if (ep->period_ns)
+			ep->period_ns += (delta - (s64)ep->period_ns) / 8;
+		else
+			ep->period_ns = delta;
+	}
+
+	ep->last_complete = timestamp;
+
+	if (static_branch_unlikely(&xusb_tap_active)) {
+		xusb_tap_record(ep, urb->transfer_buffer,
+		  urb->actual_length, timestamp, 0);
+	}
+
+	ep->receive(ep->context,
+	  urb->transfer_buffer, urb->actual_length, timestamp);
+
+	/* Shares the retry timer; only one of them can own the URB. */
+	if (xusb_endpoint_idle(ep, urb, timestamp)) {
+		ep->idle_parks++;
+		hrtimer_start(&ep->retry_timer,
+		  ms_to_ktime(max(READ_ONCE(idle_interval_ms), 1u)),
+		  HRTIMER_MODE_REL_SOFT);
+		return;
+	}
+
+	xusb_endpoint_resubmit(ep, GFP_ATOMIC);
+}
+
+/* Must be called with out_lock held. */
+static int xusb_endpoint_send_next(struct xusb_endpoint *ep)
+{
+	struct xusb_out_packet *packet;
+	int error;
+
+	lockdep_assert_held(&ep->out_lock);
+
+	if (!ep->out_count)
+		return 0;
+
+	packet = &ep->out_queue[ep->out_head];
+
+	memcpy(ep->out->transfer_buffer, packet->data, packet->length);
+	ep->out->transfer_buffer_length = packet->length;
+
+	ep->out_head = (ep->out_head + 1) % XUSB_OUT_QUEUE;
+	--ep->out_count;
+
+	if (static_branch_unlikely(&xusb_tap_active)) {
+		xusb_tap_record(ep, packet->data, packet->length,
+		  ktime_get(), XUSB_TAP_OUT);
+	}
+
+	error = usb_submit_urb(ep->out, GFP_ATOMIC);
+	ep->out_active = (error == 0);
+
+	if (error) {
+		printk(KERN_ERR "Error during submission. Error code: %d\n",
+		  error);
+		ep->out_dropped++;
+	}
+
+	return error;
+}
+
+static void xusb_endpoint_out_irq(struct urb *urb)
+{
+	struct xusb_endpoint *ep = urb->context;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ep->out_lock, flags);
+
+	ep->out_active = false;
+
+	switch (urb->status) {
+	case -ECONNRESET:
+	case -ENOENT:
+	case -ESHUTDOWN:
+		break;
+	case -EPIPE:
+		/* Carries on once halt_work has cleared it. */
+		ep->urb_errors++;
+		ep->halts++;
+		set_bit(XUSB_HALT_OUT, &ep->halted);
+		schedule_work(&ep->halt_work);
+		break;
+	default:
+		if (urb->status) {
+			ep->urb_errors++;
+			printk(KERN_ERR "Error during submission. "
+			  "Error code: %d - Actual Length %d\n",
+			  urb->status, urb->actual_length);
+		}
+
+		if (ep->out_enabled)
+			xusb_endpoint_send_next(ep);
+	}
+
+	spin_unlock_irqrestore(&ep->out_lock, flags);
+}
+
+int xusb_endpoint_send(struct xusb_endpoint *ep,
+  enum xusb_out_kind kind, const void *data, size_t length)
+{
+	struct xusb_out_packet *packet = NULL;
+	unsigned long flags;
+	int error = 0;
+
+	if (length > XUSB_OUT_PACKET_SIZE)
+		return -EINVAL;
+
+	spin_lock_irqsave(&ep->out_lock, flags);
+
+	/* Also false without an OUT endpoint or once it's destroyed. */
+	if (!ep->out_enabled) {
+		error = -ENODEV;
+		goto unlock;
+	}
+
+	/* Anything but a command replaces an unsent one of its kind. */
+	if (kind != XUSB_OUT_COMMAND) {
+		for (unsigned int i = 0; i < ep->out_count; ++i) {
+			struct xusb_out_packet *queued =
+			  &ep->out_queue[(ep->out_head + i) % XUSB_OUT_QUEUE];
+
+			if (queued->kind == kind) {
+				packet = queued;
+				break;
+			}
+		}
+	}
+
+	if (!packet) {
+		if (ep->out_count == XUSB_OUT_QUEUE) {
+			ep->out_dropped++;
+			error = -EBUSY;
+			goto unlock;
+		}
+
+		packet = &ep->out_queue[
+		  (ep->out_head + ep->out_count) % XUSB_OUT_QUEUE];
+		++ep->out_count;
+	}
+
+	memcpy(packet->data, data, length);
+	packet->length = length;
+	packet->kind = kind;
+
+	if (!ep->out_active)
+		error = xusb_endpoint_send_next(ep);
+
+unlock:
+	spin_unlock_irqrestore(&ep->out_lock, flags);
+
+	return error;
+}
+
+static int xusb_endpoint_init_out(struct xusb_endpoint *ep,
+  struct usb_endpoint_descriptor *desc)
+{
+	struct usb_device *usb_dev = interface_to_usbdev(ep->intf);
+	void *out_buffer;
+	dma_addr_t out_dma;
+
+	ep->out = usb_alloc_urb(0, GFP_KERNEL);
+	if (!ep->out)
+		return -ENOMEM;
+
+	out_buffer =
+	usb_alloc_coherent(
+		usb_dev, XUSB_OUT_PACKET_SIZE,
+		GFP_KERNEL, &out_dma);
+
+	if (!out_buffer) {
+		usb_free_urb(ep->out);
+		ep->out = NULL;
+		return -ENOMEM;
+	}
+
+	usb_fill_int_urb(
+		ep->out, usb_dev,
+		usb_sndintpipe(usb_dev, desc->bEndpointAddress),
+		out_buffer, XUSB_OUT_PACKET_SIZE,
+		xusb_endpoint_out_irq, ep, desc->bInterval);
+
+	ep->out->transfer_dma = out_dma;
+	ep->out->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+	return 0;
+}
+
+int xusb_endpoint_init(struct xusb_endpoint *ep,
+  struct usb_interface *intf, size_t packet_size,
+  xusb_receive_t receive, void *context)
+{
+	struct usb_device *usb_dev = interface_to_usbdev(intf);
+	struct usb_endpoint_descriptor *desc, *out_desc;
+
+	void *in_buffer;
+	dma_addr_t in_dma;
+	int error;
+
+	/* Not all devices list IN first. The Xbox One pads don't. */
+	error = usb_find_int_in_endpoint(intf->cur_altsetting, &desc);
+	if (error)
+		return error;
+
+	ep->intf = intf;
+	ep->packet_size = packet_size;
+	ep->receive = receive;
+	ep->context = context;
+	ep->running = false;
+	ep->work_cpu = -1;
+	ep->last_complete = 0;
+	ep->in_errors = 0;
+	ep->halted = 0;
+	ep->urb_errors = 0;
+	ep->resubmit_errors = 0;
+	ep->halts = 0;
+	ep->resets = 0;
+	ep->idle_length = 0;
+	ep->idle_since = 0;
+	ep->idle_parks = 0;
+	ep->identical_reports = 0;
+	hrtimer_setup(&ep->retry_timer, xusb_endpoint_retry,
+	  CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	INIT_WORK(&ep->halt_work, xusb_endpoint_halt_work);
+	ep->period_ns = 0;
+	mutex_init(&ep->lock);
+
+	ep->out = NULL;
+	spin_lock_init(&ep->out_lock);
+	ep->out_enabled = false;
+	ep->out_active = false;
+	ep->out_head = 0;
+	ep->out_count = 0;
+	ep->out_dropped = 0;
+	RCU_INIT_POINTER(ep->tap, NULL);
+
+	error = xusb_recorder_init(&ep->recorder, intf);
+	if (error)
+		return error;
+
+	ep->in = usb_alloc_urb(0, GFP_KERNEL);
+	if (!ep->in) {
+		error = -ENOMEM;
+		goto fail_alloc_urb;
+	}
+
+	in_buffer =
+	usb_alloc_coherent(
+		usb_dev, packet_size,
+		GFP_KERNEL, &in_dma);
+
+	if (!in_buffer) {
+		error = -ENOMEM;
+		goto fail_alloc_coherent;
+	}
+
+	if (!usb_find_int_out_endpoint(intf->cur_altsetting, &out_desc)) {
+		error = xusb_endpoint_init_out(ep, out_desc);
+
+		if (error)
+			goto fail_out;
+	}
+
+	usb_fill_int_urb(
+		ep->in, usb_dev,
+		usb_rcvintpipe(usb_dev, desc->bEndpointAddress),
+		in_buffer, packet_size,
+		xusb_endpoint_irq, ep, desc->bInterval);
+
+	ep->in->transfer_dma = in_dma;
+	ep->in->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+	ep->desc_interval = ep->in->interval;
+	ep->interval_us = poll_interval;
+
+	if (ep->interval_us) {
+		ep->in->interval =
+		  xusb_interval_to_urb(usb_dev, ep->interval_us);
+	}
+
+	usb_set_intfdata(intf, ep);
+
+	mutex_lock(&xusb_endpoints_mutex);
+	list_add_tail(&ep->node, &xusb_endpoints);
+	mutex_unlock(&xusb_endpoints_mutex);
+
+	return 0;
+
+fail_out:
+	usb_free_coherent(usb_dev, packet_size, in_buffer, in_dma);
+fail_alloc_coherent:
+	usb_free_urb(ep->in);
+fail_alloc_urb:
+	xusb_recorder_destroy(&ep->recorder);
+
+	return error;
+}
+
+void xusb_endpoint_destroy(struct xusb_endpoint *ep)
+{
+	struct usb_device *usb_dev = interface_to_usbdev(ep->intf);
+	struct urb *out;
+	unsigned long flags;
+	struct xusb_tap *tap;
+
+	xusb_endpoint_stop(ep);
+
+	/* The tap itself lives until its file is closed. */
+	mutex_lock(&xusb_endpoints_mutex);
+	list_del(&ep->node);
+
+	tap = rcu_dereference_protected(ep->tap,
+	  lockdep_is_held(&xusb_endpoints_mutex));
+
+	if (tap) {
+		RCU_INIT_POINTER(ep->tap, NULL);
+		tap->ep = NULL;
+		wake_up_interruptible(&tap->wait);
+	}
+
+	mutex_unlock(&xusb_endpoints_mutex);
+
+	xusb_recorder_destroy(&ep->recorder);
+
+	/* The pad can still be looked up by index until the transport
+	   unregisters it, so rumble and LED changes may keep coming in
+	   until then. Stopping turned them away already; this keeps a
+	   late xusb_endpoint_start() from reviving a freed URB. */
+	spin_lock_irqsave(&ep->out_lock, flags);
+	out = ep->out;
+	ep->out = NULL;
+	spin_unlock_irqrestore(&ep->out_lock, flags);
+
+	if (out) {
+		if (ep->out_dropped) {
+			printk(KERN_INFO "Dropped %lu outgoing packets\n",
+			  ep->out_dropped);
+		}
+
+		usb_free_coherent(usb_dev, XUSB_OUT_PACKET_SIZE,
+		  out->transfer_buffer, out->transfer_dma);
+		usb_free_urb(out);
+	}
+
+	usb_free_coherent(usb_dev, ep->packet_size,
+	  ep->in->transfer_buffer, ep->in->transfer_dma);
+	usb_free_urb(ep->in);
+}
+
+int xusb_endpoint_start(struct xusb_endpoint *ep)
+{
+	unsigned long flags;
+	int error;
+
+	mutex_lock(&ep->lock);
+
+	spin_lock_irqsave(&ep->out_lock, flags);
+	ep->out_enabled = (ep->out != NULL);
+	spin_unlock_irqrestore(&ep->out_lock, flags);
+
+	error = usb_submit_urb(ep->in, GFP_KERNEL);
+	ep->running = (error == 0);
+
+	mutex_unlock(&ep->lock);
+
+	return error;
+}
+
+void xusb_endpoint_stop(struct xusb_endpoint *ep)
+{
+	unsigned long flags;
+
+	mutex_lock(&ep->lock);
+
+	/* Stop anyone queueing more before killing what's in flight. */
+	spin_lock_irqsave(&ep->out_lock, flags);
+	ep->out_enabled = false;
+	ep->out_count = 0;
+	spin_unlock_irqrestore(&ep->out_lock, flags);
+
+	if (ep->out)
+		usb_kill_urb(ep->out);
+
+	xusb_endpoint_quiesce(ep);
+	ep->running = false;
+	mutex_unlock(&ep->lock);
+}
+
+int xusb_endpoint_set_interval(struct xusb_endpoint *ep,
+  unsigned int interval_us)
+{
+	struct usb_device *usb_dev = interface_to_usbdev(ep->intf);
+	int error = 0;
+
+	mutex_lock(&ep->lock);
+
+	if (ep->running)
+		xusb_endpoint_quiesce(ep);
+
+	ep->interval_us = interval_us;
+
+	if (interval_us)
+		ep->in->interval = xusb_interval_to_urb(usb_dev, interval_us);
+	else
+		ep->in->interval = ep->desc_interval;
+
+	/* The old average means nothing at the new rate. */
+	ep->last_complete = 0;
+	ep->period_ns = 0;
+
+	if (ep->running) {
+		error = usb_submit_urb(ep->in, GFP_KERNEL);
+		ep->running = (error == 0);
+	}
+
+	mutex_unlock(&ep->lock);
+
+	return error;
+}
+
+static ssize_t poll_interval_show(struct device *dev,
+  struct device_attribute *attr, char *buf)
+{
+	struct xusb_endpoint *ep = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ep->interval_us));
+}
+
+static ssize_t poll_interval_store(struct device *dev,
+  struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct xusb_endpoint *ep = dev_get_drvdata(dev);
+	unsigned int interval_us;
+	int error;
+
+	error = kstrtouint(buf, 0, &interval_us);
+	if (error)
+		return error;
+
+	error = xusb_endpoint_set_interval(ep, interval_us);
+	if (error)
+		return error;
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(poll_interval);
+
+/* What we actually observe, in microseconds. */
+static ssize_t poll_interval_actual_show(struct device *dev,
+  struct device_attribute *attr, char *buf)
+{
+	struct xusb_endpoint *ep = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%llu\n",
+	  div_u64(READ_ONCE(ep->period_ns), NSEC_PER_USEC));
+}
+
+static DEVICE_ATTR_RO(poll_interval_actual);
+
+static ssize_t cpu_show(struct device *dev,
+  struct device_attribute *attr, char *buf)
+{
+	struct xusb_endpoint *ep = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(ep->work_cpu));
+}
+
+static ssize_t cpu_store(struct device *dev,
+  struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct xusb_endpoint *ep = dev_get_drvdata(dev);
+	int cpu;
+	int error;
+
+	error = kstrtoint(buf, 0, &cpu);
+	if (error)
+		return error;
+
+	if (cpu < -1 || (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_online(cpu))))
+		return -EINVAL;
+
+	WRITE_ONCE(ep->work_cpu, cpu);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(cpu);
+
+/* Shorthand for picking a CPU on a node. Pads on the same node get
+   spread over its CPUs by interface number. */
+static ssize_t node_show(struct device *dev,
+  struct device_attribute *attr, char *buf)
+{
+	struct xusb_endpoint *ep = dev_get_drvdata(dev);
+	int cpu = READ_ONCE(ep->work_cpu);
+
+	return sysfs_emit(buf, "%d\n", cpu < 0 ? NUMA_NO_NODE : cpu_to_node(cpu));
+}
+
+static ssize_t node_store(struct device *dev,
+  struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct xusb_endpoint *ep = dev_get_drvdata(dev);
+	int node;
+	int error;
+
+	error = kstrtoint(buf, 0, &node);
+	if (error)
+		return error;
+
+	if (node < 0) {
+		WRITE_ONCE(ep->work_cpu, -1);
+		return count;
+	}
+
+	if (node >= MAX_NUMNODES || !node_online(node))
+		return -EINVAL;
+
+	WRITE_ONCE(ep->work_cpu, cpumask_local_spread(
+	  ep->intf->cur_altsetting->desc.bInterfaceNumber, node));
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(node);
+
+#define XUSB_COUNTER_ATTR(name) \
+static ssize_t name##_show(struct device *dev, \
+  struct device_attribute *attr, char *buf) \
+{ \
+	struct xusb_endpoint *ep = dev_get_drvdata(dev); \
+	return sysfs_emit(buf, "%lu\n", READ_ONCE(ep->name)); \
+} \
+static DEVICE_ATTR_RO(name)
+
+XUSB_COUNTER_ATTR(urb_errors);
+XUSB_COUNTER_ATTR(resubmit_errors);
+XUSB_COUNTER_ATTR(halts);
+XUSB_COUNTER_ATTR(resets);
+XUSB_COUNTER_ATTR(idle_parks);
+XUSB_COUNTER_ATTR(identical_reports);
+
+static struct attribute *xusb_endpoint_attrs[] = {
+	&dev_attr_poll_interval.attr,
+	&dev_attr_poll_interval_actual.attr,
+	&dev_attr_cpu.attr,
+	&dev_attr_node.attr,
+	&dev_attr_urb_errors.attr,
+	&dev_attr_resubmit_errors.attr,
+	&dev_attr_halts.attr,
+	&dev_attr_resets.attr,
+	&dev_attr_idle_parks.attr,
+	&dev_attr_identical_reports.attr,
+	NULL
+};
+
+const struct attribute_group xusb_endpoint_group = {
+	.attrs = xusb_endpoint_attrs
+};
+
+const struct attribute_group *xusb_endpoint_groups[] = {
+	&xusb_endpoint_group,
+	NULL
+};
+
+static int xusb_open(struct inode *inode, struct file *file)
+{
+	struct xusb_client *client = kzalloc(sizeof(*client), GFP_KERNEL);
+
+	if (!client)
+		return -ENOMEM;
+
+	spin_lock_init(&client->lock);
+	client->mask = GENMASK(XINPUT_LIMIT - 1, 0);
+	init_waitqueue_head(&client->wait);
+	hrtimer_setup(&client->timer, xusb_client_timer,
+	  CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+
+	mutex_lock(&xusb_clients_mutex);
+	list_add_tail_rcu(&client->node, &xusb_clients);
+	mutex_unlock(&xusb_clients_mutex);
+
+	file->private_data = client;
+
+	return nonseekable_open(inode, file);
+}
+
+static int xusb_release(struct inode *inode, struct file *file)
+{
+	struct xusb_client *client = file->private_data;
+	unsigned long flags;
+
+	/* Keep xusb_notify_clients() from arming the timer again. */
+	spin_lock_irqsave(&client->lock, flags);
+	client->mask = 0;
+	spin_unlock_irqrestore(&client->lock, flags);
+
+	mutex_lock(&xusb_clients_mutex);
+	list_del_rcu(&client->node);
+	mutex_unlock(&xusb_clients_mutex);
+
+	synchronize_rcu();
+	hrtimer_cancel(&client->timer);
+
+	if (client->eventfd)
+		eventfd_ctx_put(client->eventfd);
+
+	kfree(client);
+
+	return 0;
+}
+
+static void xusb_fill_event(struct xusb_event *event,
+  u32 index, const struct xusb_state *state)
+{
+	memset(event, 0, sizeof(*event));
+	event->dwUserIndex = index;
+	event->dwPacketNumber = state->State.dwPacketNumber;
+	event->Timestamp = ktime_to_ns(state->Timestamp);
+	event->Gamepad = state->State.Gamepad;
+}
+
+static ssize_t xusb_read(struct file *file, char __user *buffer,
+  size_t count, loff_t *ppos)
+{
+	struct xusb_client *client = file->private_data;
+	struct xusb_event event;
+	struct xusb_state state;
+	unsigned long flags;
+	size_t written = 0;
+	u32 pending;
+	int error;
+
+	if (count < sizeof(event))
+		return -EINVAL;
+
+retry:
+	if (!READ_ONCE(client->ready)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		error = wait_event_interruptible(client->wait,
+		  READ_ONCE(client->ready));
+
+		if (error)
+			return error;
+	}
+
+	/* Edges first, they're older than any state below. */
+	while (written + sizeof(event) <= count) {
+		spin_lock_irqsave(&client->lock, flags);
+
+		if (!client->edge_count) {
+			spin_unlock_irqrestore(&client->lock, flags);
+			break;
+		}
+
+		event = client->edges[client->edge_head % XUSB_CLIENT_EDGES];
+		client->edge_head++;
+		client->edge_count--;
+		spin_unlock_irqrestore(&client->lock, flags);
+
+		if (copy_to_user(buffer + written, &event, sizeof(event)))
+			return -EFAULT;
+
+		written += sizeof(event);
+	}
+
+	spin_lock_irqsave(&client->lock, flags);
+	pending = client->pending;
+	client->pending = 0;
+	client->ready = client->edge_count != 0;
+	spin_unlock_irqrestore(&client->lock, flags);
+
+	while (pending && written + sizeof(event) <= count) {
+		u32 index = __ffs(pending);
+
+		pending &= ~BIT(index);
+
+		/* Disconnected since, nothing to report. */
+		if (xusb_get_state(index, &state))
+			continue;
+
+		xusb_fill_event(&event, index, &state);
+
+		if (copy_to_user(buffer + written, &event, sizeof(event)))
+			return -EFAULT;
+
+		written += sizeof(event);
+	}
+
+	/* Didn't fit, leave them for the next read. */
+	if (pending) {
+		spin_lock_irqsave(&client->lock, flags);
+		client->pending |= pending;
+		client->ready = true;
+		spin_unlock_irqrestore(&client->lock, flags);
+	}
+
+	/* Everything pending went away before we got to it. A zero
+	   return would read as end of file. */
+	if (!written) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		goto retry;
+	}
+
+	return written;
+}
+
+static __poll_t xusb_poll(struct file *file, poll_table *wait)
+{
+	struct xusb_client *client = file->private_data;
+
+	poll_wait(file, &client->wait, wait);
+
+	return READ_ONCE(client->ready) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static long xusb_ioctl_set_wait(struct xusb_client *client,
+  void __user *argp)
+{
+	struct xusb_wait wait;
+	unsigned long flags;
+
+	if (copy_from_user(&wait, argp, sizeof(wait)))
+		return -EFAULT;
+
+	if (!wait.mask)
+		wait.mask = GENMASK(XINPUT_LIMIT - 1, 0);
+
+	spin_lock_irqsave(&client->lock, flags);
+	client->mask = wait.mask & GENMASK(XINPUT_LIMIT - 1, 0);
+	client->pending &= client->mask;
+	client->coalesce_ns = (u64)wait.coalesce_us * NSEC_PER_USEC;
+	spin_unlock_irqrestore(&client->lock, flags);
+
+	return 0;
+}
+
+static long xusb_ioctl_set_edges(struct xusb_client *client,
+  void __user *argp)
+{
+	unsigned long flags;
+	u32 mask;
+
+	if (copy_from_user(&mask, argp, sizeof(mask)))
+		return -EFAULT;
+
+	if (mask > U16_MAX)
+		return -EINVAL;
+
+	spin_lock_irqsave(&client->lock, flags);
+	client->edge_mask = mask;
+
+	/* Nothing queued under the old mask is wanted anymore. */
+	if (!mask)
+		client->edge_count = 0;
+
+	spin_unlock_irqrestore(&client->lock, flags);
+
+	return 0;
+}
+
+static long xusb_ioctl_set_eventfd(struct xusb_client *client,
+  void __user *argp)
+{
+	struct eventfd_ctx *eventfd = NULL, *old;
+	unsigned long flags;
+	s32 fd;
+
+	if (copy_from_user(&fd, argp, sizeof(fd)))
+		return -EFAULT;
+
+	if (fd >= 0) {
+		eventfd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(eventfd))
+			return PTR_ERR(eventfd);
+	}
+
+	spin_lock_irqsave(&client->lock, flags);
+	old = client->eventfd;
+	client->eventfd = eventfd;
+	spin_unlock_irqrestore(&client->lock, flags);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+static int xusb_tap_release(struct inode *inode, struct file *file)
+{
+	struct xusb_tap *tap = file->private_data;
+
+	mutex_lock(&xusb_endpoints_mutex);
+
+	if (tap->ep)
+		RCU_INIT_POINTER(tap->ep->tap, NULL);
+
+	mutex_unlock(&xusb_endpoints_mutex);
+
+	/* Waits out anyone still in xusb_tap_record(). */
+	synchronize_rcu();
+	static_branch_dec(&xusb_tap_active);
+
+	vfree(tap->header);
+	kfree(tap);
+
+	return 0;
+}
+
+static __poll_t xusb_tap_poll(struct file *file, poll_table *wait)
+{
+	struct xusb_tap *tap = file->private_data;
+	struct xusb_tap_frame *newest;
+	__poll_t mask = 0;
+	unsigned long flags;
+
+	poll_wait(file, &tap->wait, wait);
+
+	spin_lock_irqsave(&tap->lock, flags);
+	newest = &tap->ring[(tap->head - 1) & (tap->frames - 1)];
+
+	if (smp_load_acquire(&newest->status) == XUSB_TAP_USER)
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	spin_unlock_irqrestore(&tap->lock, flags);
+
+	if (!READ_ONCE(tap->ep))
+		mask |= EPOLLHUP;
+
+	return mask;
+}
+
+static int xusb_tap_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct xusb_tap *tap = file->private_data;
+
+	/* Checks the size against the allocation for us. */
+	return remap_vmalloc_range(vma, tap->header, vma->vm_pgoff);
+}
+
+static const struct file_operations xusb_tap_fops = {
+	.owner = THIS_MODULE,
+	.release = xusb_tap_release,
+	.poll = xusb_tap_poll,
+	.mmap = xusb_tap_mmap,
+};
+
+static struct xusb_endpoint *xusb_find_endpoint(
+  const struct xusb_tap_request *request)
+{
+	struct xusb_endpoint *ep;
+
+	list_for_each_entry(ep, &xusb_endpoints, node) {
+		struct usb_device *usb_dev = interface_to_usbdev(ep->intf);
+
+		if (usb_dev->bus->busnum == request->busnum &&
+		    usb_dev->devnum == request->devnum &&
+		    ep->intf->cur_altsetting->desc.bInterfaceNumber ==
+		      request->ifnum)
+			return ep;
+	}
+
+	return NULL;
+}
+
+static long xusb_ioctl_tap(void __user *argp)
+{
+	struct xusb_tap_request request;
+	struct xusb_endpoint *ep;
+	struct xusb_tap *tap;
+	struct file *file;
+	size_t offset, size;
+	int fd, error;
+
+	if (copy_from_user(&request, argp, sizeof(request)))
+		return -EFAULT;
+
+	if (!request.frames)
+		request.frames = XUSB_TAP_DEFAULT_FRAMES;
+
+	if (!is_power_of_2(request.frames) ||
+	    request.frames > XUSB_TAP_MAX_FRAMES)
+		return -EINVAL;
+
+	tap = kzalloc(sizeof(*tap), GFP_KERNEL);
+	if (!tap)
+		return -ENOMEM;
+
+	offset = ALIGN(sizeof(struct xusb_tap_header), SMP_CACHE_BYTES);
+	size = offset + request.frames * sizeof(struct xusb_tap_frame);
+
+	/* Zeroed, so every frame starts out as XUSB_TAP_KERNEL. */
+	tap->header = vmalloc_user(size);
+	if (!tap->header) {
+		error = -ENOMEM;
+		goto fail_ring;
+	}
+
+	/* The fd is only installed once the tap is attached, so
+	   userspace never sees a half set up one. */
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		error = fd;
+		goto fail_fd;
+	}
+
+	tap->header->frames = request.frames;
+	tap->header->frame_size = sizeof(struct xusb_tap_frame);
+	tap->header->offset = offset;
+	tap->ring = (void *)tap->header + offset;
+	tap->frames = request.frames;
+	spin_lock_init(&tap->lock);
+	init_waitqueue_head(&tap->wait);
+
+	static_branch_inc(&xusb_tap_active);
+
+	mutex_lock(&xusb_endpoints_mutex);
+
+	ep = xusb_find_endpoint(&request);
+	if (!ep) {
+		error = -ENODEV;
+		goto fail_attach;
+	}
+
+	if (rcu_access_pointer(ep->tap)) {
+		error = -EBUSY;
+		goto fail_attach;
+	}
+
+	file = anon_inode_getfile("[xusb-tap]", &xusb_tap_fops, tap,
+	  O_RDWR | O_CLOEXEC);
+	if (IS_ERR(file)) {
+		error = PTR_ERR(file);
+		goto fail_attach;
+	}
+
+	/* From here on xusb_tap_release() cleans up. */
+	tap->ep = ep;
+	rcu_assign_pointer(ep->tap, tap);
+
+	mutex_unlock(&xusb_endpoints_mutex);
+
+	fd_install(fd, file);
+
+	return fd;
+
+fail_attach:
+	mutex_unlock(&xusb_endpoints_mutex);
+	static_branch_dec(&xusb_tap_active);
+	put_unused_fd(fd);
+fail_fd:
+	vfree(tap->header);
+fail_ring:
+	kfree(tap);
+
+	return error;
+}
+
+static long xusb_ioctl_history(void __user *argp)
+{
+	struct xusb_history_query query;
+	struct xusb_history_entry entry;
+	struct xusb_history_entry __user *out;
+	struct xusb_history *history;
+	u64 head, oldest, first, last;
+	u32 copied = 0;
+
+	if (copy_from_user(&query, argp, sizeof(query)))
+		return -EFAULT;
+
+	if (query.dwUserIndex >= XINPUT_LIMIT || query.From > query.To)
+		return -EINVAL;
+
+	history = &xusb_histories[query.dwUserIndex];
+	out = u64_to_user_ptr(query.entries);
+
+	head = smp_load_acquire(&history->header->head);
+	oldest = head > XUSB_HISTORY_SIZE ? head - XUSB_HISTORY_SIZE : 0;
+
+	/* Newest entry at or before To... */
+	for (last = head; last > oldest; --last) {
+		if (xusb_history_read(history, last - 1, &entry) &&
+		    entry.Timestamp <= query.To)
+			break;
+	}
+
+	/* ...and the one in effect at From. */
+	for (first = last; first > oldest; --first) {
+		if (xusb_history_read(history, first - 1, &entry) &&
+		    entry.Timestamp <= query.From)
+			break;
+	}
+
+	if (first > oldest)
+		--first;
+
+	/* Anything overwritten since gets skipped. */
+	for (u64 i = first; i < last && copied < query.count; ++i) {
+		if (!xusb_history_read(history, i, &entry))
+			continue;
+
+		if (copy_to_user(&out[copied], &entry, sizeof(entry)))
+			return -EFAULT;
+
+		++copied;
+	}
+
+	query.count = max_t(u64, copied, last - first);
+
+	return copy_to_user(argp, &query, sizeof(query)) ? -EFAULT : 0;
+}
+
+static long xusb_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct xusb_client *client = file->private_data;
+	void __user *argp = (void __user *)arg;
+
+	switch (cmd) {
+	case XUSB_IOC_SET_WAIT:
+		return xusb_ioctl_set_wait(client, argp);
+
+	case XUSB_IOC_SET_EVENTFD:
+		return xusb_ioctl_set_eventfd(client, argp);
+
+	case XUSB_IOC_SET_EDGES:
+		return xusb_ioctl_set_edges(client, argp);
+
+	case XUSB_IOC_TAP:
+		return xusb_ioctl_tap(argp);
+
+	case XUSB_IOC_HISTORY:
+		return xusb_ioctl_history(argp);
+
+	case XUSB_IOC_GET_STATE: {
+		struct xusb_event event;
+		struct xusb_state state;
+		int error;
+
+		if (copy_from_user(&event, argp, sizeof(event)))
+			return -EFAULT;
+
+		if (event.dwUserIndex >= XINPUT_LIMIT)
+			return -EINVAL;
+
+		error = xusb_get_state(event.dwUserIndex, &state);
+		if (error)
+			return error;
+
+		xusb_fill_event(&event, event.dwUserIndex, &state);
+
+		return copy_to_user(argp, &event, sizeof(event)) ? -EFAULT : 0;
+	}
+
+	case XUSB_IOC_GET_KEYSTROKE: {
+		struct xusb_ioctl_keystroke out;
+		struct xusb_keystroke keystroke;
+		int error;
+
+		if (copy_from_user(&out, argp, sizeof(out)))
+			return -EFAULT;
+
+		if (out.dwUserIndex >= XINPUT_LIMIT)
+			return -EINVAL;
+
+		error = xusb_get_keystroke(out.dwUserIndex, &keystroke);
+		if (error)
+			return error;
+
+		out.Reserved = 0;
+		out.Timestamp = ktime_to_ns(keystroke.Timestamp);
+		out.Keystroke = keystroke.Keystroke;
+
+		return copy_to_user(argp, &out, sizeof(out)) ? -EFAULT : 0;
+	}
+	}
+
+	return -ENOTTY;
+}
+
+/* Maps a pad's history read-only. See XUSB_HISTORY_OFFSET(). */
+static int xusb_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	unsigned long shift = 24 - PAGE_SHIFT;
+	unsigned long index = vma->vm_pgoff >> shift;
+
+	if (vma->vm_pgoff & ((1UL << shift) - 1) || index >= XINPUT_LIMIT)
+		return -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	return remap_vmalloc_range(vma, xusb_histories[index].header, 0);
+}
+
+static const struct file_operations xusb_fops = {
+	.owner = THIS_MODULE,
+	.open = xusb_open,
+	.release = xusb_release,
+	.read = xusb_read,
+	.poll = xusb_poll,
+	.unlocked_ioctl = xusb_ioctl,
+	.mmap = xusb_mmap,
+	.compat_ioctl = compat_ptr_ioctl,
+};
+
+static ssize_t copilot_show(struct device *dev,
+  struct device_attribute *attr, char *buf)
+{
+	unsigned long flags;
+	int length = 0;
+
+	spin_lock_irqsave(&xusb_merge_lock, flags);
+
+	for (int p = 0; p < XINPUT_LIMIT; ++p) {
+		if (xusb_merge_targets[p] != p)
+			continue;
+
+		length += sysfs_emit_at(buf, length, "%d", p);
+
+		for (int i = 0; i < XINPUT_LIMIT; ++i) {
+			if (i != p && xusb_merge_targets[i] == p)
+				length += sysfs_emit_at(buf, length, " %d", i);
+		}
+
+		length += sysfs_emit_at(buf, length, "\n");
+	}
+
+	spin_unlock_irqrestore(&xusb_merge_lock, flags);
+
+	return length;
+}
+
+/* "P M..." makes P the primary of a group with members M. "P" on
+   its own breaks P's group up. */
+static ssize_t copilot_store(struct device *dev,
+  struct device_attribute *attr, const char *buf, size_t count)
+{
+	int indices[XINPUT_LIMIT];
+	char *copy, *cursor, *token;
+	unsigned long flags;
+	int error = 0;
+	int n = 0;
+
+	copy = kstrndup(buf, count, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	cursor = copy;
+
+	while ((token = strsep(&cursor, " \t\n"))) {
+		int index;
+
+		if (!*token)
+			continue;
+
+		if (n == XINPUT_LIMIT || kstrtoint(token, 10, &index) ||
+		    index < 0 || index >= XINPUT_LIMIT) {
+			error = -EINVAL;
+			break;
+		}
+
+		indices[n++] = index;
+	}
+
+	kfree(copy);
+
+	if (error)
+		return error;
+
+	if (!n)
+		return -EINVAL;
+
+	/* Keeps pads from leaving or moving while we look. */
+	mutex_lock(&xusb_index_mutex);
+	spin_lock_irqsave(&xusb_merge_lock, flags);
+
+	/* Groups are made of pads, so there has to be one on each index,
+	   and nobody can be in two groups. */
+	for (int k = 0; k < n; ++k) {
+		int target = xusb_merge_targets[indices[k]];
+
+		if (!rcu_access_pointer(xusb_index[indices[k]])) {
+			error = -ENODEV;
+			goto out;
+		}
+
+		if (target >= 0 && target != indices[0]) {
+			error = -EBUSY;
+			goto out;
+		}
+	}
+
+	for (int i = 0; i < XINPUT_LIMIT; ++i) {
+		if (xusb_merge_targets[i] == indices[0]) {
+			WRITE_ONCE(xusb_merge_targets[i], -1);
+			clear_bit(i, &xusb_merge_have);
+		}
+	}
+
+	if (n > 1) {
+		for (int k = 0; k < n; ++k)
+			WRITE_ONCE(xusb_merge_targets[indices[k]], indices[0]);
+	}
+
+out:
+	spin_unlock_irqrestore(&xusb_merge_lock, flags);
+	mutex_unlock(&xusb_index_mutex);
+
+	return error ? error : count;
+}
+
+static DEVICE_ATTR_RW(copilot);
+
+static struct attribute *xusb_misc_attrs[] = {
+	&dev_attr_copilot.attr,
+	NULL
+};
+
+ATTRIBUTE_GROUPS(xusb_misc);
+
+static struct miscdevice xusb_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "xusb",
+	.fops = &xusb_fops,
+	.groups = xusb_misc_groups,
+};
+
+void xusb_flush(void)
+{
+	/* Unregistering flushes the input work it needs to. */
+	flush_workqueue(xusb_register_wq);
+	flush_workqueue(xusb_wq);
+}
+
+EXPORT_SYMBOL_GPL(xusb_get_state);
+EXPORT_SYMBOL_GPL(xusb_get_keystroke);
+EXPORT_SYMBOL_GPL(xusb_set_vibration);
+EXPORT_SYMBOL_GPL(xusb_set_trigger_vibration);
+EXPORT_SYMBOL_GPL(xusb_report_input);
+EXPORT_SYMBOL_GPL(xusb_attach_chatpad);
+EXPORT_SYMBOL_GPL(xusb_report_chatpad);
+EXPORT_SYMBOL_GPL(xusb_begin_report);
+EXPORT_SYMBOL_GPL(xusb_commit_report);
+EXPORT_SYMBOL_GPL(xusb_unregister_device);
+EXPORT_SYMBOL_GPL(xusb_register_device);
+EXPORT_SYMBOL_GPL(xusb_flush);
+EXPORT_SYMBOL_GPL(xusb_endpoint_init);
+EXPORT_SYMBOL_GPL(xusb_endpoint_destroy);
+EXPORT_SYMBOL_GPL(xusb_endpoint_start);
+EXPORT_SYMBOL_GPL(xusb_endpoint_stop);
+EXPORT_SYMBOL_GPL(xusb_endpoint_set_interval);
+EXPORT_SYMBOL_GPL(xusb_endpoint_send);
+EXPORT_SYMBOL_GPL(xusb_endpoint_unknown);
+EXPORT_SYMBOL_GPL(xusb_endpoint_group);
+EXPORT_SYMBOL_GPL(xusb_endpoint_groups);
+
+static int __init xusb_init(void)
 {
 
-	xusb_wq = alloc_ordered_workqueue("xusb", 0);
+	int error;
+
+	xusb_wq = alloc_workqueue("xusb", WQ_HIGHPRI, 0);
 
 	if (xusb_wq == NULL) {
 		return -ENOMEM;
 	}
 
+	xusb_register_wq = alloc_ordered_workqueue("xusb_register", 0);
+
+	if (xusb_register_wq == NULL) {
+		error = -ENOMEM;
+		goto fail_register_wq;
+	}
+
+	xusb_debugfs = debugfs_create_dir("xusb", NULL);
+
+	error = xusb_history_init();
+	if (error)
+		goto fail_history;
+
+	error = misc_register(&xusb_misc);
+	if (error)
+		goto fail_misc;
+
+	xusb_bpf_init();
+
 	return 0;
+
+fail_misc:
+	xusb_history_destroy();
+fail_history:
+	debugfs_remove(xusb_debugfs);
+	destroy_workqueue(xusb_register_wq);
+fail_register_wq:
+	destroy_workqueue(xusb_wq);
+
+	return error;
 }
 
 static void __exit xusb_exit(void)
 {
+	misc_deregister(&xusb_misc);
+	xusb_history_destroy();
+	debugfs_remove(xusb_debugfs);
+	destroy_workqueue(xusb_register_wq);
 	destroy_workqueue(xusb_wq);
+
+	/* Pending xusb_context_free_rcu() calls live in this module. */
+	rcu_barrier();
 }
 
 
@@ -1,6 +1,19 @@
 #pragma once
 
+/* The XInput definitions and the /dev/xusb interface at the bottom
+   are usable from userspace. Everything else is kernel only. */
+
 #include <linux/types.h>
+#include <linux/ioctl.h>
+
+#ifdef __KERNEL__
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/usb.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#endif
 
 #define XINPUT_DEVTYPE_GAMEPAD          0x01
 
@@ -102,29 +115,43 @@
 #define XINPUT_KEYSTROKE_REPEAT         0x0004
 
 typedef struct _XINPUT_VIBRATION {
-	u16 wLeftMotorSpeed;
-	u16 wRightMotorSpeed;
+	__u16 wLeftMotorSpeed;
+	__u16 wRightMotorSpeed;
 } XINPUT_VIBRATION, *PXINPUT_VIBRATION;
 
 typedef struct _XINPUT_GAMEPAD {
-	u16 wButtons;
-	u8  bLeftTrigger;
-	u8  bRightTrigger;
-	s16 sThumbLX;
-	s16 sThumbLY;
-	s16 sThumbRX;
-	s16 sThumbRY;
+	__u16 wButtons;
+	__u8  bLeftTrigger;
+	__u8  bRightTrigger;
+	__s16 sThumbLX;
+	__s16 sThumbLY;
+	__s16 sThumbRX;
+	__s16 sThumbRY;
 } XINPUT_GAMEPAD, *PXINPUT_GAMEPAD;
 
+typedef struct _XINPUT_STATE {
+	__u32 dwPacketNumber;
+	XINPUT_GAMEPAD Gamepad;
+} XINPUT_STATE, *PXINPUT_STATE;
+
+typedef struct _XINPUT_KEYSTROKE {
+	__u16 VirtualKey;
+	__u16 Unicode;
+	__u16 Flags;
+	__u8  UserIndex;
+	__u8  HidCode;
+} XINPUT_KEYSTROKE, *PXINPUT_KEYSTROKE;
+
 typedef struct _XINPUT_CAPABILITIES {
-	u8  Type;
-	u8  SubType;
-	u16 Flags;
+	__u8  Type;
+	__u8  SubType;
+	__u16 Flags;
 	XINPUT_GAMEPAD   Gamepad;
 	XINPUT_VIBRATION Vibration;
 } XINPUT_CAPABILITIES, *PXINPUT_CAPABILITIES;
 
 /* Driver-level definitions. */
+#ifdef __KERNEL__
 struct xusb_context; /* Opaque type. */
 
 enum XINPUT_LED_STATUS {
@@ -157,16 +184,242 @@ enum XINPUT_LED_STATUS {
  */
 
 struct xusb_driver {
-	/* Synonymous to a write callback. */
+	/* Synonymous to a write callback. Called from any context,
+	   including with interrupts disabled, so these must not block.
+	   Use xusb_endpoint_send(). set_led may be NULL if there's no
+	   LED, in which case no LED device is registered either. */
 	void (*set_led)(void *, enum XINPUT_LED_STATUS);
 	void (*set_vibration)(void *, XINPUT_VIBRATION);
+
+	/* Optional. Impulse trigger motors on Xbox One pads. XInput has
+	   no equivalent so we reuse XINPUT_VIBRATION, left and right
+	   being the respective triggers. */
+	void (*set_trigger_vibration)(void *, XINPUT_VIBRATION);
 };
 
+/* The original Xbox pad has pressure sensitive face buttons.
+   They're exposed as extra absolute axes, in this order. */
+#define XUSB_DEVICE_ANALOG_BUTTONS      0x0001
+
+#define XUSB_ANALOG_A                   0
+#define XUSB_ANALOG_B                   1
+#define XUSB_ANALOG_X                   2
+#define XUSB_ANALOG_Y                   3
+#define XUSB_ANALOG_BLACK               4
+#define XUSB_ANALOG_WHITE               5
+#define XUSB_ANALOG_BUTTONS             6
+
 struct xusb_device {
 	const char *name;
 	XINPUT_CAPABILITIES *caps;
+	unsigned int flags;
+};
+
+/* What a transport hands to xusb for each input packet.
+   bAnalogButtons is only looked at if the device has
+   XUSB_DEVICE_ANALOG_BUTTONS. */
+struct xusb_report {
+	XINPUT_GAMEPAD Gamepad;
+	u8 bAnalogButtons[XUSB_ANALOG_BUTTONS];
+};
+
+/* Chatpad modifier bits, as the chatpad sends them. */
+#define XUSB_CHATPAD_SHIFT      0x01
+#define XUSB_CHATPAD_GREEN      0x02
+#define XUSB_CHATPAD_ORANGE     0x04
+#define XUSB_CHATPAD_MESSENGER  0x08
+
+struct xusb_chatpad_report {
+	u8 modifiers;
+	u8 keys[2];             /* Chatpad scan codes, 0 for none */
+};
+
+/* What a BPF program attached to xusb_bpf_remap() gets. The report
+   itself is reached through xusb_bpf_get_data(), which is what makes
+   it writable. */
+struct xusb_bpf_ctx {
+	int index;              /* XInput index, may be -1 */
+	u32 device_flags;
+	ktime_t timestamp;
+	struct xusb_report *report;
+};
+
+/* XInput has no notion of when a state was sampled. We carry the
+   time the URB completed alongside the usual structures so that
+   callers can do their own latency compensation. */
+struct xusb_state {
+	XINPUT_STATE State;
+	ktime_t Timestamp;
+};
+
+struct xusb_keystroke {
+	XINPUT_KEYSTROKE Keystroke;
+	ktime_t Timestamp;
 };
 
+/* Shared interrupt IN plumbing. Every transport has a single IN
+   endpoint it polls and they all handled it the same way, so the URB,
+   its completion handler and the polling interval live here.
+
+   Transports embed one of these in their context and get called back
+   with each successfully received packet. xusb_endpoint_init() takes
+   over the interface's driver data; use container_of() on
+   usb_get_intfdata() to get back to the transport context. */
+typedef void (*xusb_receive_t)(void *context,
+  u8 *data, u32 length, ktime_t timestamp);
+
+/* Outgoing packets are queued and sent from the OUT URB's completion
+   handler, never waited on. LED and rumble packets replace one of the
+   same kind that hasn't gone out yet since only the latest matters.
+   Commands are always sent in order. */
+#define XUSB_OUT_QUEUE 8
+#define XUSB_OUT_PACKET_SIZE 64
+
+enum xusb_out_kind {
+	XUSB_OUT_COMMAND,
+	XUSB_OUT_LED,
+	XUSB_OUT_RUMBLE
+};
+
+struct xusb_out_packet {
+	u8 data[XUSB_OUT_PACKET_SIZE];
+	u8 length;
+	u8 kind;
+};
+
+struct xusb_tap;
+
+/* How much of a packet is compared to tell whether it's idle. */
+#define XUSB_IDLE_COMPARE 64
+
+/* Flight recorder. Always on, a second or so at 1000Hz. */
+#define XUSB_RECORDER_SIZE 1024
+
+enum xusb_record_type {
+	XUSB_RECORD_REPORT,     /* Parsed, code unused */
+	XUSB_RECORD_DROP,       /* Input queue full */
+	XUSB_RECORD_URB_ERROR,  /* code is urb->status */
+	XUSB_RECORD_UNKNOWN,    /* code is whatever the transport passed */
+};
+
+struct xusb_record {
+	u32 seq;                /* Index + 1 once complete, 0 while written */
+	u32 type;
+	s64 time_ns;
+	s32 code;
+	XINPUT_GAMEPAD Gamepad;
+};
+
+struct xusb_recorder {
+	/* Anyone can record, claiming slots with head. */
+	atomic_t head;
+	struct xusb_record *ring;
+
+	/* Copy taken when something went wrong, see debugfs. */
+	struct mutex snapshot_lock;
+	struct xusb_record *snapshot;
+	unsigned int snapshot_head;
+	const char *snapshot_reason;
+	ktime_t snapshot_time;
+	unsigned long last_snapshot; /* jiffies */
+
+	const char *pending_reason;
+	struct work_struct work;
+
+	/* Only touched from the completion handler. */
+	ktime_t unknown_start;
+	unsigned int unknown_count;
+
+	struct dentry *debugfs;
+};
+
+struct xusb_endpoint {
+	struct usb_interface *intf;
+	struct list_head node; /* On the list XUSB_IOC_TAP searches */
+	struct urb *in;
+	size_t packet_size;
+
+	xusb_receive_t receive;
+	void *context;
+
+	/* Protects the fields below against sysfs. */
+	struct mutex lock;
+	bool running;
+	int desc_interval; /* urb->interval the descriptor asked for */
+	unsigned int interval_us; /* 0 means use the descriptor */
+
+	/* CPU to run input work on. -1 runs it wherever the URB
+	   completed, which is wherever the host controller's interrupt
+	   is handled. */
+	int work_cpu;
+
+	/* Only touched from the completion handler. */
+	ktime_t last_complete;
+	u64 period_ns; /* Moving average of completion period */
+
+	/* Error recovery. Whichever of the completion handler, the
+	   retry timer and halt_work owns the IN URB at the moment
+	   touches these. The counters are only ever read for sysfs. */
+	unsigned int in_errors; /* In a row, reset on success */
+	struct hrtimer retry_timer;
+	struct work_struct halt_work;
+	unsigned long halted; /* XUSB_HALT_* bits */
+	unsigned long urb_errors;
+	unsigned long resubmit_errors;
+	unsigned long halts;
+	unsigned long resets;
+
+	/* Adaptive polling, see idle_timeout_ms. Completion handler
+	   only, like the above. */
+	u8 idle_packet[XUSB_IDLE_COMPARE];
+	u32 idle_length;
+	ktime_t idle_since;
+	unsigned long idle_parks;
+	unsigned long identical_reports;
+
+	/* OUT side. out is NULL if the interface has no OUT endpoint. */
+	struct urb *out;
+	spinlock_t out_lock;
+	bool out_enabled;
+	bool out_active;
+	struct xusb_out_packet out_queue[XUSB_OUT_QUEUE];
+	unsigned int out_head;
+	unsigned int out_count;
+	unsigned long out_dropped;
+
+	/* Raw packet capture, NULL unless someone's attached. */
+	struct xusb_tap __rcu *tap;
+
+	struct xusb_recorder recorder;
+};
+
+int xusb_endpoint_init(struct xusb_endpoint *ep,
+  struct usb_interface *intf, size_t packet_size,
+  xusb_receive_t receive, void *context);
+void xusb_endpoint_destroy(struct xusb_endpoint *ep);
+
+int xusb_endpoint_start(struct xusb_endpoint *ep);
+void xusb_endpoint_stop(struct xusb_endpoint *ep);
+
+/* For packets the transport doesn't understand. Only records them,
+   but a burst of them is treated as something gone wrong. */
+void xusb_endpoint_unknown(struct xusb_endpoint *ep, s32 code);
+
+/* Safe from any context. Returns -EBUSY if the queue is full of
+   commands, -ENODEV if the endpoint is stopped or has no OUT side. */
+int xusb_endpoint_send(struct xusb_endpoint *ep,
+  enum xusb_out_kind kind, const void *data, size_t length);
+
+/* interval_us of 0 restores the descriptor's interval. The URB is
+   resubmitted if it's running. May sleep. */
+int xusb_endpoint_set_interval(struct xusb_endpoint *ep,
+  unsigned int interval_us);
+
+/* Suitable for usb_driver.dev_groups. Transports with attributes
+   of their own can list xusb_endpoint_group alongside them. */
+extern const struct attribute_group xusb_endpoint_group;
+extern const struct attribute_group *xusb_endpoint_groups[];
+
 /* The XUSB driver is driven by an single threaded workqueue.
    Each of these functions are generally driven by a work item
    submitted to that queue to help ease synchronization issues.
@@ -183,13 +436,199 @@ struct xusb_device {
    or flexible design here.
  */
 
+/* ep is the endpoint the device is reached through. Its interface
+   becomes the parent of the input and LED devices. */
 struct xusb_context* xusb_register_device(
+  struct xusb_endpoint *ep,
   struct xusb_driver *driver,
   struct xusb_device *device,
   void *context);
 
 void xusb_unregister_device(struct xusb_context* ctx);
 
-void xusb_report_input(struct xusb_context* ctx, const XINPUT_GAMEPAD *input);
+/* timestamp should be taken as early as possible, ideally at the
+   top of the URB completion handler. It's what ends up in the evdev
+   event and in the state returned below. */
+void xusb_report_input(struct xusb_context* ctx,
+  const XINPUT_GAMEPAD *input, ktime_t timestamp);
+
+/* Same thing without the copy. xusb_begin_report() hands out the
+   next queue slot for the transport to parse into, or NULL if the
+   queue is full and the report should be dropped. Nothing is visible
+   until xusb_commit_report(). Both must come from the same completion
+   handler invocation. */
+struct xusb_report *xusb_begin_report(struct xusb_context *ctx);
+void xusb_commit_report(struct xusb_context *ctx, ktime_t timestamp);
+
+/* Registers (or removes) a keyboard input device for a chatpad
+   plugged into the pad. Safe from the completion handler.
+   Unregistering the pad removes it as well. */
+void xusb_attach_chatpad(struct xusb_context *ctx, bool attached);
+
+/* Same rules as xusb_report_input(). Turned into key events on the
+   chatpad's keyboard device by the input work, if it's attached. */
+void xusb_report_chatpad(struct xusb_context *ctx,
+  const struct xusb_chatpad_report *report, ktime_t timestamp);
+
+/* Analogous to XInputGetState() and XInputGetKeystroke().
+   Both return 0 on success, -ENODEV if nothing is connected at
+   index and xusb_get_keystroke() returns -EAGAIN if empty. */
+int xusb_get_state(u8 index, struct xusb_state *state);
+int xusb_get_keystroke(u8 index, struct xusb_keystroke *keystroke);
+
+/* Analogous to XInputSetState(). Returns -EOPNOTSUPP if the device
+   can't do it. Safe from any context. */
+int xusb_set_vibration(u8 index, const XINPUT_VIBRATION *vibration);
+int xusb_set_trigger_vibration(u8 index, const XINPUT_VIBRATION *vibration);
 
 void xusb_flush(void);
+#endif /* __KERNEL__ */
+
+/* /dev/xusb
+
+   One open file can wait on any number of pads at once. Select the
+   pads with XUSB_IOC_SET_WAIT, then poll()/epoll or block in read().
+   The file becomes readable once per batch of changes: after the
+   first change it won't wake again until read() consumes the batch,
+   and never more often than coalesce_us apart. read() fills in one
+   xusb_event per pad that changed with that pad's latest state.
+
+   XUSB_IOC_SET_EVENTFD additionally signals an eventfd on the same
+   wakeups, for loops that already wait on one. Pass -1 to remove it.
+
+   A reader that only needs the state every so often, like a menu or
+   an overlay, can set a large coalesce_us and still see every button
+   press with XUSB_IOC_SET_EDGES. It takes a mask of wButtons bits; a
+   change to any of them wakes the file right away, even inside the
+   coalescing window, and is queued with XUSB_EVENT_EDGE set so a
+   press and release between reads isn't lost. read() returns queued
+   edges oldest first, then the latest states as usual, which may
+   repeat the last edge (compare dwPacketNumber). 0 turns it off. */
+
+struct xusb_wait {
+	__u32 mask;             /* Bit per XInput index, 0 is all */
+	__u32 coalesce_us;      /* Minimum time between wakeups */
+};
+
+struct xusb_event {
+	__u32 dwUserIndex;
+	__u32 dwPacketNumber;
+	__s64 Timestamp;        /* CLOCK_MONOTONIC, nanoseconds */
+	XINPUT_GAMEPAD Gamepad;
+	__u32 Flags;
+};
+
+#define XUSB_EVENT_EDGE         0x0001  /* Queued by XUSB_IOC_SET_EDGES */
+
+struct xusb_ioctl_keystroke {
+	__u32 dwUserIndex;
+	__u32 Reserved;
+	__s64 Timestamp;
+	XINPUT_KEYSTROKE Keystroke;
+};
+
+#define XUSB_IOC_MAGIC          'x'
+
+#define XUSB_IOC_SET_WAIT       _IOW(XUSB_IOC_MAGIC, 0x01, struct xusb_wait)
+#define XUSB_IOC_SET_EVENTFD    _IOW(XUSB_IOC_MAGIC, 0x02, __s32)
+
+/* dwUserIndex selects the pad, the rest is filled in. */
+#define XUSB_IOC_GET_STATE      _IOWR(XUSB_IOC_MAGIC, 0x03, struct xusb_event)
+#define XUSB_IOC_GET_KEYSTROKE  _IOWR(XUSB_IOC_MAGIC, 0x04, struct xusb_ioctl_keystroke)
+#define XUSB_IOC_SET_EDGES      _IOW(XUSB_IOC_MAGIC, 0x07, __u32)
+
+/* Raw packet tap
+
+   XUSB_IOC_TAP returns a new file descriptor that captures every
+   packet going in or out of one interface, picked by its USB bus,
+   device and interface numbers (as in /sys/bus/usb/devices). mmap()
+   it from offset 0 for the whole ring: an xusb_tap_header followed
+   by header.frames frames, header.offset bytes in.
+
+   Same idea as PACKET_MMAP. A frame belongs to the kernel while its
+   status is XUSB_TAP_KERNEL. The kernel fills frames in order and
+   hands each one over by setting XUSB_TAP_USER; give it back by
+   storing XUSB_TAP_KERNEL once done with it. If the next frame
+   still belongs to userspace the packet is counted in dropped
+   instead. poll() says readable when the newest frame is waiting,
+   and hangs up once the device is gone. Only one tap per interface. */
+
+#define XUSB_TAP_KERNEL         0
+#define XUSB_TAP_USER           1
+
+#define XUSB_TAP_OUT            0x01 /* Host to device */
+
+#define XUSB_TAP_DATA_SIZE      64
+
+struct xusb_tap_request {
+	__u32 busnum;
+	__u32 devnum;
+	__u32 ifnum;
+	__u32 frames;           /* Power of two, 0 for the default */
+};
+
+struct xusb_tap_header {
+	__u32 frames;
+	__u32 frame_size;
+	__u32 offset;
+	__u32 dropped;
+};
+
+struct xusb_tap_frame {
+	__u32 status;
+	__u16 length;           /* Length of the packet on the wire */
+	__u8 captured;          /* Bytes of it in data */
+	__u8 flags;
+	__s64 Timestamp;        /* CLOCK_MONOTONIC, nanoseconds */
+	__u8 data[XUSB_TAP_DATA_SIZE];
+};
+
+#define XUSB_IOC_TAP            _IOW(XUSB_IOC_MAGIC, 0x05, struct xusb_tap_request)
+
+/* Input history
+
+   Every change in a pad's state goes into a ring per XInput index,
+   stamped with the time its URB completed, so it's possible to ask
+   what a pad's state was at any recent moment. That's recent as in
+   the last XUSB_HISTORY_SIZE changes, a few seconds of constant
+   stick movement and far more otherwise. The ring follows the index,
+   not the pad: a pad that disconnects and reconnects elsewhere
+   leaves its history behind.
+
+   XUSB_IOC_HISTORY copies out every state in effect between From
+   and To, in order. The first one is the state at From, which may
+   have started earlier; From == To asks for the state at that time.
+   count is how many entries fit at entries going in, and how many
+   there were in the range coming out, which may be more than fit.
+
+   The rings can also be mapped read-only at XUSB_HISTORY_OFFSET().
+   header.head counts the entries written; entry i lives in slot
+   i % header.size and is valid only while its seq is i + 1. */
+
+#define XUSB_HISTORY_SIZE       4096
+#define XUSB_HISTORY_OFFSET(i)  ((__u64)(i) << 24)
+
+struct xusb_history_header {
+	__u32 size;
+	__u32 entry_size;
+	__u32 offset;
+	__u32 Reserved;
+	__u64 head;
+};
+
+struct xusb_history_entry {
+	__u64 seq;
+	__s64 Timestamp;        /* CLOCK_MONOTONIC, nanoseconds */
+	__u32 dwPacketNumber;
+	XINPUT_GAMEPAD Gamepad;
+};
+
+struct xusb_history_query {
+	__u32 dwUserIndex;
+	__u32 count;
+	__s64 From;
+	__s64 To;
+	__u64 entries;          /* struct xusb_history_entry * */
+};
+
+#define XUSB_IOC_HISTORY        _IOWR(XUSB_IOC_MAGIC, 0x06, struct xusb_history_query)